@@ -8,18 +8,202 @@
 
 /* TODO: manage attributes */
 
+/* For posix_openpt and the other pseudo-terminal functions */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "vtparse.h"
+#include "hlvt_trace.h"
+#include "wcwidth_table.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <poll.h>
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
+
+/* Count parameter of a CSI sequence, 0 or missing means 1 */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define CSI_COUNT(p) \
+  ((p)->num_params == 0 || (p)->params[0] == 0 ? 1u : (p)->params[0])
+
+/* Number of columns (0, 1 or 2) used by a character, the two level */
+/* table is generated by wcwidth_gen_c_tables.rb                    */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define CP_WIDTH(cp) \
+  (WIDTH_BLOCKS[WIDTH_INDEX[(cp) >> WIDTH_BLOCK_SHIFT]][(cp)&WIDTH_BLOCK_MASK])
+
+/* Content of the cell covered by the right half of a wide character */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define WIDE_CONT 0u
+
+/* A cell whose character is made of several code points (grapheme */
+/* cluster) contains CLUSTER_TAG | index in the cluster table.      */
+/* The code points added to a full cluster are dropped.             */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define CLUSTER_TAG 0x80000000u
+#define CLUSTER_MAX 32
+
+/* Screen digests (-d) are 128 bit wide, the 64 bit words are mixed */
+/* into two lanes with the round function of XXH64, started from     */
+/* different seeds, which are combined and avalanched at the end as  */
+/* in MurmurHash3_x64_128.                                           */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_SEED1  0x9e3779b97f4a7c15ULL
+#define HASH_SEED2  0x60bee2bee120fc15ULL
+
+/* Number of trace records (-T) buffered before being written */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define TRACE_RECORDS 4096
+
+/* The search index (-I) is written when it holds INDEX_SLOTS / 2 */
+/* tokens or INDEX_MEMORY bytes. The tokens are cut after         */
+/* INDEX_TOKEN_MAX bytes.                                         */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define INDEX_SLOTS 65536
+#define INDEX_MEMORY (8u << 20)
+#define INDEX_TOKEN_MAX 64
+
+/* The pipelined mode (-p) passes the actions from the parsing thread  */
+/* to the emulation thread in PIPELINE_CHUNKS chunks of PIPELINE_CHUNK */
+/* bytes, the records in a chunk are aligned on 8 bytes. The payloads  */
+/* of the strings are split in records of at most PIPELINE_STRING_MAX */
+/* bytes.                                                              */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define PIPELINE_CHUNK 65536
+#define PIPELINE_CHUNKS 8
+#define PIPELINE_ROUND(n) (((n) + 7) & ~(size_t)7)
+#define PIPELINE_STRING_MAX (PIPELINE_CHUNK - sizeof(pipeline_action_t))
+
+/* Size of the reads of the typescript and of the buffers given to */
+/* vtparse                                                          */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define INPUT_CHUNK 65536
+
+/* Counters and timings shown by -S, they cost an addition per event */
+/* and a clock read per read, parse or display. They are compiled    */
+/* out with -S itself by defining NO_STATS.                          */
+/* STAT_TIME(t, counter) adds the time elapsed since STAT_CLOCK(t).  */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#ifndef NO_STATS
+#define STAT_ADD(counter, n) (stats.counter += (n))
+#define STAT_CLOCK(t) ((t) = clock_ns())
+#define STAT_TIME(t, counter) ((counter) += clock_ns() - (t))
+#else
+#define STAT_ADD(counter, n) ((void)sizeof(n))
+#define STAT_CLOCK(t) ((void)sizeof(t))
+#define STAT_TIME(t, counter) ((void)sizeof(t))
+#endif
+
+/* Character sets which can be designated as G0 to G3 */
+/* """""""""""""""""""""""""""""""""""""""""""""""""" */
+#define CHARSET_US           0
+#define CHARSET_UK           1
+#define CHARSET_DEC_GRAPHICS 2
+#define CHARSETS             3
+
+/* Extended colors set by SGR 38 and 48 */
+/* """""""""""""""""""""""""""""""""""" */
+#define COLOR_INDEXED 0x1000000u /* | index in the 256 colors palette */
+#define COLOR_RGB     0x2000000u /* | 0xRRGGBB                        */
+
+/* Tab stops are stored in a bitset, the next or previous stop is */
+/* found by counting the trailing or leading zeros of a word.     */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define TAB_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+#if defined(__GNUC__)
+#define CTZL(w) ((unsigned)__builtin_ctzl(w))
+#define CLZL(w) ((unsigned)__builtin_clzl(w))
+#else
+#define CTZL(w) ctzl(w)
+#define CLZL(w) clzl(w)
+
+static unsigned
+ctzl(unsigned long w)
+{
+  unsigned n = 0;
+
+  while (!(w & 1))
+  {
+    w >>= 1;
+    n++;
+  }
+  return n;
+}
+
+static unsigned
+clzl(unsigned long w)
+{
+  unsigned n = 0;
+
+  while (!(w & (1UL << (TAB_BITS - 1))))
+  {
+    w <<= 1;
+    n++;
+  }
+  return n;
+}
+#endif
+
+/* Session arena: the blocks are carved from chunks of ARENA_CHUNK bytes */
+/* aligned on ARENA_ALIGN bytes. The cell arrays have CELL_CLASSES size  */
+/* classes of CELLS_MIN, 2 * CELLS_MIN, 4 * CELLS_MIN... cells.          */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define ARENA_CHUNK 65536
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CELLS_MIN 4u
+#define CELL_CLASSES 30
 
 typedef struct ll_node_s     ll_node_t;
 typedef struct ll_s          ll_t;
 typedef struct screen_s      screen_t;
 typedef struct line_s        line_t;
+typedef struct cell_s        cell_t;
 typedef struct attrs_bytes_s attrs_bytes_t;
+typedef struct clusters_s    clusters_t;
+typedef struct arena_s       arena_t;
+typedef struct arena_chunk_s arena_chunk_t;
+typedef struct arena_block_s arena_block_t;
+typedef struct snapshot_s    snapshot_t;
+typedef struct stats_s       stats_t;
+typedef struct pipeline_s    pipeline_t;
+
+typedef struct pipeline_chunk_s  pipeline_chunk_t;
+typedef struct pipeline_action_s pipeline_action_t;
+
+typedef struct emulator_s emulator_t;
+typedef struct session_s  session_t;
+typedef struct source_s   source_t;
+
+typedef struct index_entry_s index_entry_t;
+typedef struct digest_s      digest_t;
 
 static void *
 xmalloc(size_t size);
@@ -33,6 +217,24 @@ xrealloc(void * ptr, size_t size);
 char *
 xstrdup(const char * p);
 
+static void *
+arena_alloc(size_t size);
+
+static void
+arena_release(void);
+
+static unsigned
+cells_class(unsigned cells);
+
+static cell_t *
+cells_alloc(unsigned class);
+
+static void
+cells_free(cell_t * cells, unsigned allocated);
+
+static void
+ll_free_node(ll_node_t * node);
+
 static int
 ll_append(ll_t * const list, void * const data);
 
@@ -40,17 +242,17 @@ ll_append(ll_t * const list, void * const data);
 static int
 ll_prepend(ll_t * const list, void * const data);
 
-/* Not used here */
-#if 0
-static void
-ll_insert_before(ll_t * const list, ll_node_t * node, void * const data);
-
 static void
 ll_insert_after(ll_t * const list, ll_node_t * node, void * const data);
 
 static int
 ll_delete(ll_t * const list, ll_node_t * node);
 
+/* Not used here */
+#if 0
+static void
+ll_insert_before(ll_t * const list, ll_node_t * node, void * const data);
+
 static ll_node_t *
 ll_find(ll_t * const, void * const, int (*)(const void *, const void *));
 #endif
@@ -70,18 +272,333 @@ usage(char * prog);
 static line_t *
 line_new();
 
+static line_t *
+line_touch(ll_node_t * node);
+
+static void
+row_clear(ll_node_t * node);
+
+static void
+snapshot_take(screen_t * s, snapshot_t * snap);
+
+static void
+snapshot_release(snapshot_t * snap);
+
+static void
+digest_init(digest_t * d);
+
+static void
+digest_add(digest_t * d, uint64_t v);
+
+static uint64_t
+digest_fmix(uint64_t h);
+
+static void
+digest_final(digest_t * d);
+
+static void
+attrs_hash(attrs_bytes_t * attrs);
+
+static attrs_bytes_t *
+attrs_intern(attrs_bytes_t * attrs);
+
+static digest_t *
+line_hash(line_t * line);
+
+static void
+screen_hash(screen_t * screen, digest_t * d);
+
+static void
+line_release(line_t * line);
+
+static void
+line_clear(line_t * line);
+
+static void
+line_reserve(line_t * line, unsigned cells);
+
+static void
+line_blank(line_t * line, unsigned from, unsigned to);
+
+static void
+line_split_wide(line_t * line, unsigned column);
+
+static void
+line_write(line_t * line, unsigned column, cell_t * cells, unsigned w,
+           unsigned n);
+
+static void
+line_insert(line_t * line, unsigned column, unsigned n);
+
+static void
+line_delete(line_t * line, unsigned column, unsigned n);
+
+static void
+ll_unlink_chain(ll_t * const list, ll_node_t * first, ll_node_t * last);
+
+static void
+ll_move_before(ll_t * const list, ll_node_t * first, ll_node_t * last,
+               ll_node_t * node);
+
+static void
+ll_move_after(ll_t * const list, ll_node_t * first, ll_node_t * last,
+              ll_node_t * node);
+
+static unsigned
+cluster_hash(unsigned * cps, unsigned n);
+
+static unsigned *
+cluster_get(unsigned * cp, unsigned * n);
+
+static unsigned
+cluster_intern(unsigned * cps, unsigned n);
+
+static void
+cell_attach(cell_t * cell, unsigned cp);
+
+static cell_t *
+line_cell_before(line_t * line, unsigned column);
+
+static int
+utf8_encode(unsigned cp, char * out);
+
+static char *
+line_string(line_t * line);
+
 static void
 display(screen_t * screen, unsigned height);
 
+static int
+region_bound(int index, unsigned size);
+
+static void
+region_print(screen_t * s, int top, int left, int bottom, int right);
+
+static void
+screen_show(void);
+
+static void
+snapshot_signal(int sig);
+
+static void
+snapshot_pipe_open(void);
+
+static void
+control_read(void);
+
+static void
+snapshot_check(void);
+
+static ssize_t
+input_read(int fd, unsigned char * buf, size_t size);
+
+static ssize_t
+read_retry(int fd, unsigned char * buf, size_t size);
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+static void
+source_truncated(const char * reason);
+
+static ssize_t
+source_gunzip(source_t * src, unsigned char * buf, size_t size);
+#endif
+
+static ssize_t
+source_read(source_t * src, unsigned char * buf, size_t size);
+
+static void
+source_close(source_t * src);
+
 static line_t *
 line_new();
 
 void
 screen_init(screen_t * s, unsigned height_opt);
 
+static void
+screen_line_feed(screen_t * s);
+
+static void
+screen_save_cursor(screen_t * s);
+
+static void
+screen_restore_cursor(screen_t * s);
+
+static void
+screen_switch(unsigned alt, unsigned mode);
+
+static void
+screen_clamp_column(screen_t * s);
+
+static unsigned
+reflow_row_cells(cell_t * buf, unsigned from, unsigned len);
+
+static void
+screen_reflow(screen_t * s, unsigned old_width);
+
+static void
+screen_set_height(screen_t * s, unsigned height);
+
+static void
+resize(unsigned height, unsigned columns);
+
+static void
+screen_tabs_reserve(screen_t * s, unsigned columns);
+
+static unsigned
+screen_tab_next(screen_t * s, unsigned column);
+
+static unsigned
+screen_tab_prev(screen_t * s, unsigned column);
+
+static void
+screen_wrap(screen_t * s);
+
+static void
+screen_put(screen_t * s, cell_t * cells, unsigned w, unsigned n);
+
 static int
 compar(const void * a, const void * b);
 
+static void
+color_print(unsigned sgr, unsigned color);
+
+static unsigned
+sgr_color(vtparse_t * parser, unsigned i, unsigned * color);
+
+static void
+charset_init(void);
+
+static void
+charset_update(void);
+
+static void
+osc_put(unsigned char * data, unsigned len);
+
+static void
+limit_reached(const char * limit);
+
+static void
+heap_charge(size_t size);
+
+static void
+heap_release(size_t size);
+
+static int
+size_opt(char * arg, size_t * size);
+
+#ifndef NO_STATS
+static uint64_t
+clock_ns(void);
+
+static void
+stats_print(void);
+#endif
+
+static void
+trace_open(const char * path);
+
+static void
+trace_flush(void);
+
+static void
+trace_action(vtparse_t * parser, vtparse_action_t action, unsigned char ch);
+
+static void
+trace_close(void);
+
+static void
+index_open(const char * path);
+
+static void
+index_token_end(void);
+
+static void
+index_add(void);
+
+static void
+index_line(line_t * line);
+
+static int
+index_cmp(const void * a, const void * b);
+
+static void
+index_flush(void);
+
+static void
+index_close(void);
+
+static void
+pipeline_wait(unsigned * spins);
+
+static pipeline_action_t *
+pipeline_reserve(size_t size);
+
+static void
+pipeline_publish(void);
+
+static void
+pipeline_callback(vtparse_t * parser, vtparse_action_t action,
+                  unsigned char ch);
+
+static void *
+pipeline_producer(void * arg);
+
+static void
+pipeline_apply(pipeline_chunk_t * chunk, vtparse_t * parser);
+
+static size_t
+pipeline_run(vtparse_t * parser);
+
+static void
+emulator_save(emulator_t * e);
+
+static void
+emulator_load(emulator_t * e);
+
+static void
+emulator_free(void);
+
+static session_t *
+session_new(int fd, unsigned height, unsigned string_limit);
+
+static int
+session_input(session_t * s);
+
+static void
+session_render(session_t * s);
+
+static int
+session_reply(session_t * s);
+
+static void
+session_free(session_t * s);
+
+static void
+serve(const char * path, unsigned height, unsigned string_limit);
+
+static int
+write_all(int fd, const char * data, size_t len);
+
+static int
+client(const char * path);
+
+static void
+pty_answer(const char * answer);
+
+static int
+pty_run(char ** argv, unsigned height, unsigned columns, vtparse_t * parser,
+        size_t * total);
+
+static void
+osc_dispatch(void);
+
+static unsigned
+link_hash(const char * uri);
+
+static void
+link_intern(const char * uri);
+
 /* ******************************* */
 /* Linked list specific structures */
 /* ******************************* */
@@ -104,45 +621,434 @@ struct ll_s
   size_t      len;
 };
 
-struct line_s
+/* State of a digest, then the digest itself after digest_final */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct digest_s
 {
-  unsigned         allocated; /* allocated memory                  */
-  unsigned         length;    /* number of multiobytes in the line */
-  unsigned         bytes;     /* nb of bytes in the line           */
-  unsigned char *  string;    /* line content                      */
-  attrs_bytes_t ** attrs;     /* array of attributes affected to    *
-                                        each column of the line           */
+  uint64_t lanes[2]; /* accumulators                */
+  uint64_t words;    /* number of words mixed in it */
 };
 
-struct attrs_bytes_s
+/* A line is an array of fixed size cells, one per column, so that  */
+/* characters can be inserted, deleted or erased with a single bulk */
+/* move of the cells.                                               */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct line_s
 {
-  size_t          len;   /* number of bytes forming the attributes */
-  unsigned char * bytes; /* attributes                             */
+  unsigned allocated; /* number of allocated cells                   */
+  unsigned length;    /* number of used cells in the line            */
+  unsigned wrapped;   /* 1 if the line continues on the next one     *
+                       * because of an autowrap (soft wrapped line)  */
+  unsigned refs;      /* number of rows and snapshots using the line *
+                       * the line is immutable while it exceeds 1    */
+  unsigned hashed;    /* 1 if hash is up to date                     */
+  digest_t hash;      /* digest of the content, see line_hash        */
+  cell_t * cells;     /* line content                                */
 };
 
-attrs_bytes_t curr_attrs_bytes;
+/* A wide character uses two cells, the second one only contains */
+/* WIDE_CONT.                                                     */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct cell_s
+{
+  unsigned        cp;    /* UTF-8 decoded character in the cell or  */
+                         /* CLUSTER_TAG | index in the cluster table */
+  attrs_bytes_t * attrs; /* attributes of the cell, NULL if none     */
+};
 
-struct screen_s
+/* The grapheme clusters are interned, a cluster used by many cells */
+/* is only stored once. Their code points are stored end to end in  */
+/* a single array and found by a hash table of indexes.             */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct clusters_s
 {
-  ll_node_t * top;
-  ll_node_t * bottom;
-  ll_node_t * current;
-  unsigned    saved_row;
-  unsigned    column;
-  unsigned    saved_column;
-  ll_t *      lines;
+  unsigned * cps;           /* code points of all the clusters         */
+  unsigned   cps_len;       /* number of used entries in cps           */
+  unsigned   cps_allocated; /* number of allocated entries in cps      */
+  unsigned * starts;        /* cluster i uses cps[starts[i]] to        *
+                             * cps[starts[i + 1] - 1]                  */
+  unsigned   count;         /* number of clusters                      */
+  unsigned   allocated;     /* number of allocated entries in starts   */
+  unsigned * buckets;       /* hash table of cluster indexes + 1,      *
+                             * 0 for an empty bucket                   */
+  unsigned   buckets_len;   /* number of buckets, a power of 2         */
 };
 
-screen_t screen;
+clusters_t clusters;
 
-char * my_optarg;     /* Global argument pointer. */
-int    my_optind = 0; /* Global argv index. */
+/* The lines, their cells, the list nodes and the attributes are carved */
+/* from large chunks owned by the session arena. The blocks of a line   */
+/* which is dropped go to free lists, one per size class for the cells, */
+/* and are reused first. All the chunks are released at once when the   */
+/* session ends.                                                        */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct arena_chunk_s
+{
+  arena_chunk_t * next; /* previously allocated chunk */
+  size_t          size; /* size of the chunk in bytes */
+};
+
+struct arena_block_s
+{
+  arena_block_t * next; /* next free block of the same kind */
+};
+
+struct arena_s
+{
+  arena_chunk_t * chunks;   /* allocated chunks, newest first           */
+  char *          next;     /* first free byte of the newest chunk      */
+  size_t          left;     /* number of free bytes after next          */
+  arena_block_t * lines;    /* free line_t structures                   */
+  arena_block_t * nodes;    /* free linked list nodes                   */
+  arena_block_t * cells[CELL_CLASSES]; /* free cell arrays by size class */
+};
+
+static arena_t arena;
+
+/* The rows never written share this immutable empty line, their own */
+/* line is only allocated by line_touch before their first change.   */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static line_t blank_line;
+
+/* A snapshot holds references on the lines of the rows of a screen, */
+/* taking one costs a pointer per row. A line shared with snapshots  */
+/* is copied by line_touch when its row is modified.                  */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct snapshot_s
+{
+  line_t ** lines;      /* lines of the rows from the top of the screen */
+  unsigned  rows;       /* number of rows, including the lines kept     *
+                         * after the bottom of the screen               */
+  unsigned  height;     /* number of rows in the screen                 */
+  unsigned  cursor_row; /* row of the cursor                            */
+};
+
+/* Attributes are never modified once created so that the same */
+/* structure can be shared by all the cells using it.          */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct attrs_bytes_s
+{
+  size_t          len;   /* number of bytes forming the attributes */
+  unsigned char * bytes; /* attributes                             */
+  unsigned        fg;    /* extended foreground color, 0 if none   */
+  unsigned        bg;    /* extended background color, 0 if none   */
+  uint64_t        hash;  /* digest of what attrs_print shows, 0 if *
+                          * nothing is shown                       */
+};
+
+attrs_bytes_t * curr_attrs = NULL;
+
+/* The attribute structures are shared by the cells and interned in an */
+/* open addressing hash table on their digest, so that there is one    */
+/* structure per distinct set of attributes.                           */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static attrs_bytes_t ** attrs_buckets;     /* NULL for a free bucket */
+static unsigned         attrs_buckets_len; /* power of 2             */
+static unsigned         attrs_nb;          /* number of structures   */
+
+struct screen_s
+{
+  ll_node_t * top;
+  ll_node_t * bottom;
+  ll_node_t * current;
+  unsigned    saved_row;
+  unsigned    column;
+  unsigned    saved_column;
+  unsigned    height;  /* number of lines of the screen              */
+  unsigned    history; /* 1: keep the scrolled up lines, 0: recycle */
+  ll_t *      lines;
+
+  unsigned long * tabs;         /* tab stops, one bit per column           */
+  unsigned        tabs_len;     /* number of columns in the bitset         */
+  unsigned        tabs_default; /* 1 if the columns after the bitset have  *
+                                 * the default stops, 0 after a TBC 3      */
+};
+
+/* The alternate screen is only allocated the first time it is used  */
+/* and its lines are then reused, switching screens only changes the */
+/* active screen pointer.                                            */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+screen_t   main_screen;
+screen_t   alt_screen;
+screen_t * screen = &main_screen;
+
+char * my_optarg;     /* Global argument pointer. */
+int    my_optind = 0; /* Global argv index. */
 int    my_opterr = 1; /* for compatibility, should error be printed? */
 int    my_optopt;     /* for compatibility, option character checked */
 
 static const char * prog = "hlvt";
 static char *       scan = NULL; /* Private scan pointer. */
 static unsigned     no_attr;
+static unsigned     frame_opt;    /* -f: display the window's frame    */
+static unsigned     digest_opt;   /* -d: display the digest instead    */
+static unsigned     region_opt;   /* -r: display only region           */
+static int          region[4];    /* top, left, bottom, right          */
+static unsigned     width;        /* number of columns, 0: not limited */
+static unsigned     autowrap = 1; /* DECAWM mode                       */
+
+/* Limits protecting against hostile typescripts, 0 means no limit.  */
+/* When one of them is reached, the typescript is truncated but the   */
+/* screen is still displayed. They are checked in constant time.      */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static unsigned max_columns = 65535; /* columns when not set by -c      */
+static unsigned max_rows    = 65535; /* lines of the screen              */
+static unsigned max_history;         /* lines kept above the screen      */
+static size_t   max_heap;            /* bytes used by the screen content */
+static size_t   max_bytes;           /* bytes of typescript processed    */
+static size_t   heap_used;           /* bytes used by the screen content */
+static unsigned stopped;             /* 1 when the parsing is stopped    */
+
+/* Statistics on the processing of the typescript, see -S */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct stats_s
+{
+  size_t        bytes;         /* bytes of typescript processed       */
+  unsigned long actions[16];   /* parser actions received, by type    */
+  unsigned long csi[128];      /* CSI sequences by final byte         */
+  unsigned long esc[128];      /* ESC sequences by final byte         */
+  unsigned long cell_moves;    /* bulk moves of cells (ICH, DCH, line *
+                                * growths, reflows)                   */
+  unsigned long cells_moved;   /* number of cells moved by them       */
+  unsigned long allocs;        /* calls to the xmalloc family         */
+  size_t        alloc_bytes;   /* bytes requested by these calls      */
+  size_t        peak_history;  /* largest number of lines kept above  *
+                                * the screen                          */
+  uint64_t      read_ns;       /* time spent reading the typescript   */
+  uint64_t      parse_ns;      /* time spent parsing and emulating    */
+  uint64_t      display_ns;    /* time spent displaying the screen    */
+};
+
+#ifndef NO_STATS
+static stats_t stats;
+#endif
+
+/* Binary trace of the parser actions, see -T and hlvt_trace.h */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static FILE *         trace_file;      /* NULL when not tracing       */
+static const char *   trace_path;      /* used in the error messages  */
+static trace_record_t trace_buf[TRACE_RECORDS];
+static unsigned       trace_nb;        /* records in trace_buf        */
+
+/* Token of the search index and the lines where it appears, token */
+/* is NULL in a free slot.                                         */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct index_entry_s
+{
+  char *          token;
+  unsigned long * lines;     /* line numbers in increasing order */
+  unsigned        nb;        /* number of lines                  */
+  unsigned        allocated; /* number of allocated lines        */
+};
+
+/* Inverted index of the lines of the main screen, written to   */
+/* index_file (-I) as they scroll off and for the final screen. */
+/* The lines are numbered from 1 in the order they are indexed. */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static FILE *          index_file;   /* NULL when not indexing        */
+static const char *    index_path;   /* used in the error messages    */
+static index_entry_t * index_slots;  /* INDEX_SLOTS slots hash table  */
+static unsigned        index_nb;     /* tokens in index_slots         */
+static size_t          index_memory; /* bytes used by the entries     */
+static unsigned long   index_lines;  /* number of lines indexed       */
+
+static char          index_token[INDEX_TOKEN_MAX + 1]; /* being read      */
+static unsigned      index_token_len;
+static unsigned      index_token_cut;                  /* 1 if truncated  */
+static unsigned long index_token_line;                 /* where it starts */
+
+/* Pipelined mode: a producer thread reads and parses the typescript, */
+/* the main thread applies the actions to the screen. They share a    */
+/* ring of chunks without lock, head is only written by the producer  */
+/* and tail by the consumer. A chunk is published when it is full or  */
+/* at the end of the input, which amortizes the synchronization.      */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct pipeline_chunk_s
+{
+  unsigned char data[PIPELINE_CHUNK]; /* records, see pipeline_action_t */
+  size_t        len;                  /* bytes used in data             */
+};
+
+/* Record of an action, followed by num_params parameters then by len */
+/* bytes: the printed bytes of a run of PRINT actions, or the payload  */
+/* of an OSC_PUT or PUT action.                                        */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct pipeline_action_s
+{
+  unsigned long long offset; /* offset of the (first) byte           */
+  unsigned           len;
+  unsigned short     subparams;
+  unsigned char      action;
+  unsigned char      ch;
+  unsigned char      num_intermediates;
+  unsigned char      num_params;
+  unsigned char      intermediates[MAX_INTERMEDIATE_CHARS];
+  unsigned char      params_overflow;
+};
+
+struct pipeline_s
+{
+  pipeline_chunk_t *  chunks;  /* the PIPELINE_CHUNKS chunks of the ring */
+  unsigned long       head;    /* number of chunks published             */
+  unsigned long       tail;    /* number of chunks consumed              */
+  int                 eof;     /* 1 when the last chunk is published     */
+  int                 stop;    /* 1 when the consumer has stopped        */
+  pipeline_chunk_t *  current; /* chunk filled by the producer or NULL   */
+  pipeline_action_t * run;     /* PRINT record at the end of current     */
+  size_t              total;   /* bytes of typescript read               */
+  int                 limited; /* 1 when max_bytes has been reached      */
+  uint64_t            read_ns; /* time spent reading by the producer     */
+};
+
+static pipeline_t pipeline;
+
+/* Reader of the typescript. A typescript starting with the gzip magic */
+/* bytes is inflated straight into the buffers given to vtparse, in    */
+/* the parsing thread of the pipelined mode (-p).                      */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct source_s
+{
+  int             fd;
+  int             started; /* 1 once the first bytes have been read   */
+  int             gzip;    /* 1 if the typescript is compressed       */
+  int             end;     /* 1 at the end of the raw input           */
+  int             member;  /* 1 inside a gzip member, 0 after its end */
+  unsigned char * in;      /* raw input not yet used                  */
+  size_t          in_len;
+  size_t          in_pos;
+
+  /* input_read, or read_retry in the parsing thread */
+  ssize_t (*read)(int fd, unsigned char * buf, size_t size);
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+  z_stream zs;
+#endif
+};
+
+static source_t source;
+
+/* Only the window title and the hyperlink targets are kept from the */
+/* OSC strings. The targets are found through an open addressing     */
+/* hash table like the clusters.                                     */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static char *     osc;               /* payload of the current OSC string */
+static unsigned   osc_len;           /* number of bytes in the payload    */
+static unsigned   osc_allocated;     /* number of bytes allocated for it  */
+static char *     title;             /* set by OSC 0 or 2, NULL if none   */
+static char **    links;             /* distinct targets of OSC 8 links   */
+static unsigned   links_nb;          /* number of targets                 */
+static unsigned   links_allocated;   /* number of entries allocated       */
+static unsigned * links_buckets;     /* index + 1 of a target, 0 if free  */
+static unsigned   links_buckets_len; /* power of 2                        */
+
+/* Only the ASCII characters are translated, with a single lookup in */
+/* the 128 entries table of the active character set. There is no   */
+/* table for US-ASCII, which is the common case.                     */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static unsigned   charset_tables[CHARSETS][128];
+static unsigned   charsets[4];  /* character sets designated as G0 to G3  */
+static unsigned   gl;           /* G-set invoked by SI (0) or SO (1)      */
+static unsigned   single_shift; /* 1 if SS2 or SS3 is pending             */
+static unsigned * translation;  /* table to use for the next character,   *
+                                 * NULL when no translation is needed     */
+
+/* Character being decoded from its UTF-8 bytes, and the last printed */
+/* character with its continuation cell, used by REP.                 */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static unsigned utf8_rem; /* continuation bytes still expected */
+static unsigned utf8_cp;
+static cell_t   glyph[2] = { { ' ', NULL }, { WIDE_CONT, NULL } };
+static unsigned glyph_width = 1;
+
+/* Stream receiving the display, stdout or the reply of a session */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static FILE * output;
+
+/* Master side of the pseudo-terminal of the command run by hlvt, the */
+/* answers to its queries are written there. -1 without command.      */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static int pty_fd = -1;
+
+/* Snapshots of the screen requested while the typescript is read, by */
+/* SIGUSR1 or by a "snapshot" line on the control file descriptor     */
+/* (-K). They are output between two vtparse calls.                   */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static volatile sig_atomic_t snapshot_wanted;
+
+/* The SIGUSR1 handler also writes a byte to this pipe, so that a    */
+/* signal received just before poll is waited for still wakes it up  */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+static int snapshot_pipe[2] = { -1, -1 };
+
+static int      control_fd = -1;  /* -1: none or closed     */
+static char     control_line[64]; /* command being received */
+static unsigned control_len;
+
+/* State of the emulator of a session of the daemon (-D). The emulator */
+/* works on the globals above, they are loaded from the session whose  */
+/* input is processed and saved back afterwards. The tables built at   */
+/* the start (character sets) are shared by all the sessions.          */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct emulator_s
+{
+  arena_t          arena;
+  clusters_t       clusters;
+  attrs_bytes_t *  curr_attrs;
+  attrs_bytes_t ** attrs_buckets;
+  unsigned         attrs_buckets_len;
+  unsigned         attrs_nb;
+  screen_t         main_screen;
+  screen_t         alt_screen;
+  screen_t *       screen;
+  unsigned         width;
+  unsigned         autowrap;
+  size_t           heap_used;
+  unsigned         stopped;
+  char *           osc;
+  unsigned         osc_len;
+  unsigned         osc_allocated;
+  char *           title;
+  char **          links;
+  unsigned         links_nb;
+  unsigned         links_allocated;
+  unsigned *       links_buckets;
+  unsigned         links_buckets_len;
+  unsigned         charsets[4];
+  unsigned         gl;
+  unsigned         single_shift;
+  unsigned *       translation;
+  unsigned         utf8_rem;
+  unsigned         utf8_cp;
+  cell_t           glyph[2];
+  unsigned         glyph_width;
+};
+
+/* Globals forming the state of the emulator, see emulator_t */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define EMULATOR_STATE                                                    \
+  X(arena) X(clusters) X(curr_attrs) X(attrs_buckets)                     \
+  X(attrs_buckets_len) X(attrs_nb) X(main_screen) X(alt_screen) X(screen) \
+  X(width) X(autowrap) X(heap_used) X(stopped) X(osc) X(osc_len)          \
+  X(osc_allocated) X(title) X(links) X(links_nb) X(links_allocated)       \
+  X(links_buckets) X(links_buckets_len) X(charsets) X(gl) X(single_shift) \
+  X(translation) X(utf8_rem) X(utf8_cp) X(glyph) X(glyph_width)
+
+/* A connection to the daemon: the typescript is read until the client  */
+/* shuts its side down, then the display is sent back as the reply and  */
+/* the connection is closed.                                            */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct session_s
+{
+  int        fd;
+  emulator_t emulator;
+  vtparse_t  parser;
+  size_t     total;     /* bytes of typescript received          */
+  char *     reply;     /* display to send, NULL while reading   */
+  size_t     reply_len;
+  size_t     sent;      /* bytes of the reply already sent       */
+};
+
+static emulator_t emulator_initial; /* state of a new session */
 
 /* ====================================================== */
 /* Like strspn but based on length and not on a delimiter */
@@ -171,1156 +1077,5011 @@ compar(const void * a, const void * b)
   return *(unsigned char *)a - *(unsigned char *)b;
 }
 
-/* ===================================================================t */
-/* Print the column and the attributes associated with the character at */
-/* column n of the current line.                                        */
-/* ===================================================================t */
-static int
-attrs_print(attrs_bytes_t ** attrs, size_t n)
+/* ================================================================ */
+/* Fill the translation tables of the character sets which differ  */
+/* from US-ASCII, the US-ASCII one is only used for single shifts.  */
+/* ================================================================ */
+void
+charset_init(void)
 {
-  size_t          i, offset;
-  attrs_bytes_t * v = attrs[n];
+  /* DEC special graphics from 0x60 to 0x7e */
+  /* """""""""""""""""""""""""""""""""""""" */
+  static const unsigned dec_graphics[] = {
+    0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1,
+    0x2424, 0x240b, 0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba,
+    0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c, 0x2524, 0x2534, 0x252c,
+    0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7
+  };
+
+  unsigned c, i;
+
+  for (i = 0; i < CHARSETS; i++)
+    for (c = 0; c < 128; c++)
+      charset_tables[i][c] = c;
+
+  charset_tables[CHARSET_UK]['#'] = 0x00a3;
+
+  charset_tables[CHARSET_DEC_GRAPHICS]['_'] = 0x00a0;
+  for (c = 0x60; c < 0x7f; c++)
+    charset_tables[CHARSET_DEC_GRAPHICS][c] = dec_graphics[c - 0x60];
+}
 
-  if ((offset = memspn(v->bytes, v->len, "\0", 1)) == v->len)
-    return 0;
+/* ================================================================= */
+/* Select the translation table of the G-set invoked in GL, called   */
+/* after each designation or locking shift and after a single shift  */
+/* has been used.                                                    */
+/* ================================================================= */
+void
+charset_update(void)
+{
+  single_shift = 0;
 
-  printf("%d:", n);
-  for (i = offset; i < v->len; i++)
-    printf("%02x", v->bytes[i]);
-  fputs(" ", stdout);
+  if (charsets[gl] == CHARSET_US)
+    translation = NULL;
+  else
+    translation = charset_tables[charsets[gl]];
+}
 
-  return 0;
+/* ================================================================ */
+/* Stop the parsing when a limit is reached, what has already been  */
+/* interpreted will still be displayed.                             */
+/* ================================================================ */
+void
+limit_reached(const char * limit)
+{
+  if (!stopped)
+    fprintf(stderr, "%s: %s limit reached, the input is truncated\n", prog,
+            limit);
+
+  stopped = 1;
+}
+
+/* ================================================================ */
+/* Account for size more bytes used by the screen content (lines,   */
+/* attributes, clusters, OSC strings).                              */
+/* ================================================================ */
+void
+heap_charge(size_t size)
+{
+  heap_used += size;
+  if (max_heap && heap_used > max_heap)
+    limit_reached("heap");
 }
 
 /* ======================================================= */
-/* Merge two sorted arrays, first_a with a integers and    */
-/* second_a with b integers, into a sorted array result_a. */
-/* Duplicated values are removed.                          */
+/* Account for size bytes released from the screen content */
 /* ======================================================= */
+void
+heap_release(size_t size)
+{
+  heap_used -= size;
+}
+
+/* ================================================================= */
+/* Read a size option argument, with an optional k, m or g suffix.   */
+/* Returns 0 on success and -1 if the argument is not valid.         */
+/* ================================================================= */
 int
-attrs_merge(unsigned char * first_a, int a, unsigned char * second_a, int b,
-            unsigned char * result_a)
+size_opt(char * arg, size_t * size)
 {
-  int           i, j, k;
-  unsigned char old;
+  unsigned long value;
+  int           n, end;
 
-  i   = 0;
-  j   = 0;
-  k   = 0;
-  old = '\0';
+  n = sscanf(arg, "%lu%n", &value, &end);
+  if (n != 1)
+    return -1;
 
-  while (i < a && j < b)
-  {
-    if (first_a[i] <= second_a[j])
-    {
-      /* copy first_a[i] to result_a[k] and move */
-      /* the pointer i and k forward             */
-      /* """"""""""""""""""""""""""""""""""""""" */
-      if (first_a[i] != old)
-        old = result_a[k++] = first_a[i];
-      i++;
-    }
-    else
-    {
-      /* copy second_a[j] to result_a[k] and move */
-      /* the pointer j and k forward              */
-      /* """""""""""""""""""""""""""""""""""""""" */
-      if (second_a[j] != old)
-        old = result_a[k++] = second_a[j];
-      j++;
-    }
-  }
-  /* move the remaining elements in first_a into result_a */
-  /* """""""""""""""""""""""""""""""""""""""""""""""""""" */
-  while (i < a)
-  {
-    if (first_a[i] != old)
-      old = result_a[k++] = first_a[i];
-    i++;
-  }
-  /* move the remaining elements in second_a into result_a */
-  /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
-  while (j < b)
+  switch (arg[end])
   {
-    if (second_a[j] != old)
-      old = result_a[k++] = second_a[j];
-    j++;
+    case 'k':
+    case 'K':
+      value <<= 10;
+      end++;
+      break;
+
+    case 'm':
+    case 'M':
+      value <<= 20;
+      end++;
+      break;
+
+    case 'g':
+    case 'G':
+      value <<= 30;
+      end++;
+      break;
   }
 
-  return k;
-}
+  if (arg[end] != '\0')
+    return -1;
 
-/* ********************* */
-/* Linked List functions */
-/* ********************* */
+  *size = value;
+  return 0;
+}
 
-/* ======================== */
-/* Create a new linked list */
-/* ======================== */
-ll_t *
-ll_new(void)
+#ifndef NO_STATS
+/* ========================================== */
+/* Monotonic clock in nanoseconds, used by -S */
+/* ========================================== */
+uint64_t
+clock_ns(void)
 {
-  ll_t * ret = xmalloc(sizeof(ll_t));
-  ll_init(ret);
+  struct timespec ts;
 
-  return ret;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
 }
 
-/* ======================== */
-/* Initialize a linked list */
-/* ======================== */
+/* ================================================================= */
+/* Print the statistics as a JSON object on the standard error. Only */
+/* the non-zero counters of actions and final bytes are shown.       */
+/* ================================================================= */
 void
-ll_init(ll_t * list)
+stats_print(void)
 {
-  list->head = NULL;
-  list->tail = NULL;
-  list->len  = 0;
-}
+  unsigned        i, j, first;
+  unsigned long * finals;
 
-/* ==================================================== */
-/* Allocate the space for a new node in the linked list */
-/* ==================================================== */
-ll_node_t *
-ll_new_node(void)
-{
-  ll_node_t * ret = xmalloc(sizeof(ll_node_t));
+  fprintf(stderr, "{\n  \"bytes\": %lu,\n  \"actions\": {",
+          (unsigned long)stats.bytes);
+  for (i = 1, first = 1; i < 16; i++)
+    if (stats.actions[i])
+    {
+      fprintf(stderr, "%s\"%s\": %lu", first ? "" : ", ", ACTION_NAMES[i],
+              stats.actions[i]);
+      first = 0;
+    }
 
-  if (ret == NULL)
-    errno = ENOMEM;
+  /* The final bytes are the keys, '"' and '\' must be escaped */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  for (j = 0; j < 2; j++)
+  {
+    finals = j == 0 ? stats.csi : stats.esc;
+    fprintf(stderr, "},\n  \"%s\": {", j == 0 ? "csi" : "esc");
+    for (i = 0, first = 1; i < 128; i++)
+      if (finals[i])
+      {
+        fprintf(stderr, "%s\"%s%c\": %lu", first ? "" : ", ",
+                i == '"' || i == '\\' ? "\\" : "", i, finals[i]);
+        first = 0;
+      }
+  }
 
-  return ret;
+  fprintf(stderr,
+          "},\n"
+          "  \"cell_moves\": %lu,\n"
+          "  \"cells_moved\": %lu,\n"
+          "  \"allocs\": %lu,\n"
+          "  \"alloc_bytes\": %lu,\n"
+          "  \"peak_history\": %lu,\n"
+          "  \"read_seconds\": %.6f,\n"
+          "  \"parse_seconds\": %.6f,\n"
+          "  \"display_seconds\": %.6f\n"
+          "}\n",
+          stats.cell_moves, stats.cells_moved, stats.allocs,
+          (unsigned long)stats.alloc_bytes, (unsigned long)stats.peak_history,
+          stats.read_ns / 1e9, stats.parse_ns / 1e9, stats.display_ns / 1e9);
 }
+#endif
 
-/* ==================================================================== */
-/* Append a new node filled with its data at the end of the linked list */
-/* The user is responsible for the memory management of the data        */
-/* ==================================================================== */
-int
-ll_append(ll_t * const list, void * const data)
+/* ================================================================= */
+/* Create the trace file and write its header, the program stops if  */
+/* it cannot be created.                                             */
+/* ================================================================= */
+void
+trace_open(const char * path)
 {
-  int         ret = 1;
-  ll_node_t * node;
+  trace_header_t header;
 
-  if (list)
+  trace_path = path;
+  trace_file = fopen(path, "wb");
+  if (trace_file == NULL)
   {
-    node = ll_new_node();
-    if (node)
-    {
-      node->data = data;
-      node->next = NULL;
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
 
-      node->prev = list->tail;
-      if (list->tail)
-        list->tail->next = node;
-      else
-        list->head = node;
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, TRACE_MAGIC);
+  header.version     = TRACE_VERSION;
+  header.record_size = sizeof(trace_record_t);
+  header.byte_order  = TRACE_BYTE_ORDER;
 
-      list->tail = node;
+  if (fwrite(&header, sizeof(header), 1, trace_file) != 1)
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
 
-      ++list->len;
-      ret = 0;
-    }
+/* ============================================ */
+/* Write the buffered trace records to the file */
+/* ============================================ */
+void
+trace_flush(void)
+{
+  if (trace_nb > 0
+      && fwrite(trace_buf, sizeof(trace_record_t), trace_nb, trace_file)
+           != trace_nb)
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, trace_path, strerror(errno));
+    exit(EXIT_FAILURE);
   }
 
-  return ret;
+  trace_nb = 0;
 }
 
-/* =================================================================== */
-/* Put a new node filled with its data at the beginning of the linked  */
-/* list. The user is responsible for the memory management of the data */
-/* =================================================================== */
-int
-ll_prepend(ll_t * const list, void * const data)
+/* ================================================================= */
+/* Record an action received from the parser. A PRINT directly       */
+/* following a PRINT only increments the count of its record, which  */
+/* is why the last record is kept in the buffer until a new one is   */
+/* needed. Likewise a slice of payload contiguous to the previous    */
+/* one is added to its record, so the records do not depend on how   */
+/* the input was read or split.                                      */
+/* ================================================================= */
+void
+trace_action(vtparse_t * parser, vtparse_action_t action, unsigned char ch)
 {
-  int         ret = 1;
-  ll_node_t * node;
+  trace_record_t * rec;
+  int              i;
 
-  if (list)
+  if (action == VTPARSE_ACTION_PRINT && trace_nb > 0)
   {
-    node = ll_new_node();
-    if (node)
+    rec = &trace_buf[trace_nb - 1];
+    if (rec->action == VTPARSE_ACTION_PRINT
+        && rec->offset + rec->count == parser->offset
+        && rec->count < UINT32_MAX)
     {
-      node->data = data;
-      node->prev = NULL;
+      rec->count++;
+      return;
+    }
+  }
 
-      node->next = list->head;
-      if (list->head)
-        list->head->prev = node;
-      else
-        list->tail = node;
-
-      list->head = node;
-
-      ++list->len;
-      ret = 0;
+  if ((action == VTPARSE_ACTION_OSC_PUT || action == VTPARSE_ACTION_PUT)
+      && trace_nb > 0)
+  {
+    rec = &trace_buf[trace_nb - 1];
+    if (rec->action == action
+        && rec->offset + rec->count == parser->offset
+        && rec->count <= UINT32_MAX - (uint32_t)parser->string_data_len)
+    {
+      rec->count += parser->string_data_len;
+      return;
     }
   }
 
-  return ret;
+  if (trace_nb == TRACE_RECORDS)
+    trace_flush();
+
+  rec = &trace_buf[trace_nb++];
+  memset(rec, 0, sizeof(*rec));
+
+  rec->offset = parser->offset;
+  rec->action = action;
+  rec->ch     = ch;
+  rec->count  = 1;
+
+  switch (action)
+  {
+    case VTPARSE_ACTION_OSC_PUT:
+    case VTPARSE_ACTION_PUT:
+      rec->count = parser->string_data_len;
+      break;
+
+    case VTPARSE_ACTION_CSI_DISPATCH:
+    case VTPARSE_ACTION_HOOK:
+      rec->num_params      = parser->num_params;
+      rec->subparams       = parser->subparams;
+      rec->params_overflow = parser->params_overflow;
+      for (i = 0; i < rec->num_params; i++)
+        rec->params[i] = parser->params[i];
+      /* fall through */
+
+    case VTPARSE_ACTION_ESC_DISPATCH:
+      rec->num_intermediates = parser->num_intermediate_chars;
+      for (i = 0; i < parser->num_intermediate_chars; i++)
+        rec->intermediates[i] = parser->intermediate_chars[i];
+      break;
+
+    default:
+      break;
+  }
 }
 
-/* ======================================================= */
-/* Insert a new node before the specified node in the list */
-/* TODO test it                                           */
-/* ======================================================= */
+/* ========================================== */
+/* Write the remaining records and close file */
+/* ========================================== */
 void
-ll_insert_before(ll_t * const list, ll_node_t * node, void * const data)
+trace_close(void)
 {
-  ll_node_t * new_node;
+  trace_flush();
 
-  if (list)
+  if (fclose(trace_file) != 0)
   {
-    if (node->prev == NULL)
-      ll_prepend(list, data);
-    else
-    {
-      new_node = ll_new_node();
-      if (new_node)
-      {
-        new_node->data   = data;
-        new_node->next   = node;
-        new_node->prev   = node->prev;
-        node->prev->next = new_node;
+    fprintf(stderr, "%s: %s: %s\n", prog, trace_path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
 
-        ++list->len;
-      }
-    }
+/* ================================================================= */
+/* Create the index file, the program stops if it cannot be created. */
+/* ================================================================= */
+void
+index_open(const char * path)
+{
+  index_path = path;
+  index_file = fopen(path, "w");
+  if (index_file == NULL)
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    exit(EXIT_FAILURE);
   }
+
+  index_slots = xcalloc(INDEX_SLOTS, sizeof(index_entry_t));
 }
 
-/* ====================================================== */
-/* Insert a new node after the specified node in the list */
-/* TODO test it                                           */
-/* ====================================================== */
+/* ================================================================= */
+/* Add the token being read, if any, to the index. A token cut in    */
+/* the middle of a UTF-8 sequence loses this partial sequence and    */
+/* the single ASCII characters are ignored.                          */
+/* ================================================================= */
 void
-ll_insert_after(ll_t * const list, ll_node_t * node, void * const data)
+index_token_end(void)
 {
-  ll_node_t * new_node;
+  unsigned i;
 
-  if (list)
+  if (index_token_cut)
   {
-    if (node->next == NULL)
-      ll_append(list, data);
-    else
+    for (i = index_token_len; i > 0 && (index_token[i - 1] & 0xc0) == 0x80;)
+      i--;
+
+    if (i > 0 && (unsigned char)index_token[i - 1] >= 0xc0)
     {
-      new_node = ll_new_node();
-      if (new_node)
-      {
-        new_node->data   = data;
-        new_node->prev   = node;
-        new_node->next   = node->next;
-        node->next->prev = new_node;
+      unsigned char lead = index_token[i - 1];
+      unsigned      need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
 
-        ++list->len;
-      }
+      if (index_token_len - (i - 1) < need)
+        index_token_len = i - 1;
     }
   }
-}
 
-/* ================================ */
-/* Remove a node from a linked list */
-/* ================================ */
-int
-ll_delete(ll_t * const list, ll_node_t * node)
-{
-  if (list->head == list->tail)
+  if (index_token_len > 1)
   {
-    if (list->head != NULL)
-      list->head = list->tail = NULL;
-    else
-      return 0;
+    index_token[index_token_len] = '\0';
+    index_add();
   }
-  else if (node->prev == NULL)
+
+  index_token_len = 0;
+  index_token_cut = 0;
+}
+
+/* ================================================================ */
+/* Record that index_token appears on index_token_line. The table   */
+/* is hashed with linear probing and written out when it is full.   */
+/* ================================================================ */
+void
+index_add(void)
+{
+  index_entry_t * e;
+  uint64_t        h = 14695981039346656037ULL; /* FNV-1a */
+  unsigned        i;
+
+  if (index_nb >= INDEX_SLOTS / 2 || index_memory >= INDEX_MEMORY)
+    index_flush();
+
+  for (i = 0; i < index_token_len; i++)
+    h = (h ^ (unsigned char)index_token[i]) * 1099511628211ULL;
+
+  for (i = h & (INDEX_SLOTS - 1);; i = (i + 1) & (INDEX_SLOTS - 1))
   {
-    list->head       = node->next;
-    list->head->prev = NULL;
+    e = &index_slots[i];
+
+    if (e->token == NULL)
+    {
+      e->token = xmalloc(index_token_len + 1);
+      memcpy(e->token, index_token, index_token_len + 1);
+      index_memory += index_token_len + 1;
+      index_nb++;
+      break;
+    }
+
+    if (strcmp(e->token, index_token) == 0)
+      break;
   }
-  else if (node->next == NULL)
+
+  /* The lines are indexed in order, a token repeated on a line is */
+  /* only recorded once.                                           */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (e->nb > 0 && e->lines[e->nb - 1] == index_token_line)
+    return;
+
+  if (e->nb == e->allocated)
   {
-    list->tail       = node->prev;
-    list->tail->next = NULL;
+    e->allocated = e->allocated == 0 ? 4 : e->allocated * 2;
+    e->lines     = xrealloc(e->lines, e->allocated * sizeof(unsigned long));
+    index_memory += (e->allocated - e->nb) * sizeof(unsigned long);
   }
-  else
+
+  e->lines[e->nb++] = index_token_line;
+}
+
+/* ================================================================= */
+/* Cut the content of a line into tokens and add them to the index.  */
+/* The tokens are the runs of ASCII letters, digits and underscores  */
+/* and of non ASCII characters, the ASCII letters are lowercased.    */
+/* A token continues on the next line when the line is soft wrapped, */
+/* it is then indexed on the line where it starts.                   */
+/* ================================================================= */
+void
+index_line(line_t * line)
+{
+  const unsigned char * p;
+  unsigned char         c;
+
+  index_lines++;
+
+  p = (unsigned char *)(line->length == 0 ? "" : line_string(line));
+  for (; (c = *p) != '\0'; p++)
   {
-    node->next->prev = node->prev;
-    node->prev->next = node->next;
-  }
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
 
-  --list->len;
+    if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_'
+        || c >= 0x80)
+    {
+      if (index_token_len == 0)
+        index_token_line = index_lines;
 
-  return 1;
+      if (index_token_len < INDEX_TOKEN_MAX)
+        index_token[index_token_len++] = c;
+      else
+        index_token_cut = 1;
+    }
+    else if (index_token_len > 0)
+      index_token_end();
+  }
+
+  if (!line->wrapped)
+    index_token_end();
 }
 
-/* *************************** */
-/* Memory allocation functions */
-/* *************************** */
+/* ========================================================= */
+/* qsort comparison: the free slots last, then by token.     */
+/* ========================================================= */
+int
+index_cmp(const void * a, const void * b)
+{
+  const index_entry_t * ea = a;
+  const index_entry_t * eb = b;
 
-/* Created by Kevin Locke (from numerous canonical examples)         */
-/*                                                                   */
-/* I hereby place this file in the public domain.  It may be freely  */
-/* reproduced, distributed, used, modified, built upon, or otherwise */
-/* employed by anyone for any purpose without restriction.           */
-/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (ea->token == NULL || eb->token == NULL)
+    return (ea->token == NULL) - (eb->token == NULL);
 
-/* ================= */
-/* Customized malloc */
-/* ================= */
-void *
-xmalloc(size_t size)
+  return strcmp(ea->token, eb->token);
+}
+
+/* ================================================================= */
+/* Write the tokens of the table sorted by token, one per line with  */
+/* its line numbers: token<TAB>line,line,... and empty the table.    */
+/* A token can then appear again in a next group of lines.           */
+/* ================================================================= */
+void
+index_flush(void)
 {
-  void * allocated;
-  size_t real_size;
+  index_entry_t * e;
+  unsigned        i, j;
 
-  real_size = (size > 0) ? size : 1;
-  allocated = malloc(real_size);
-  if (allocated == NULL)
+  qsort(index_slots, INDEX_SLOTS, sizeof(index_entry_t), index_cmp);
+
+  for (i = 0; i < index_nb; i++)
   {
-    fprintf(stderr,
-            "Error: Insufficient memory (attempt to malloc %lu bytes)\n",
-            (unsigned long int)size);
+    e = &index_slots[i];
 
-    exit(EXIT_FAILURE);
+    fputs(e->token, index_file);
+    for (j = 0; j < e->nb; j++)
+      fprintf(index_file, "%c%lu", j == 0 ? '\t' : ',', e->lines[j]);
+    fputc('\n', index_file);
+
+    free(e->token);
+    free(e->lines);
   }
 
-  return allocated;
+  memset(index_slots, 0, INDEX_SLOTS * sizeof(index_entry_t));
+  index_nb     = 0;
+  index_memory = 0;
 }
 
-/* ================= */
-/* Customized calloc */
-/* ================= */
-void *
-xcalloc(size_t n, size_t size)
+/* ================================================================= */
+/* Index the rows of the final screen, write what is left and close  */
+/* the file.                                                         */
+/* ================================================================= */
+void
+index_close(void)
 {
-  void * allocated;
+  ll_node_t * node;
 
-  n         = (n > 0) ? n : 1;
-  size      = (size > 0) ? size : 1;
-  allocated = calloc(n, size);
-  if (allocated == NULL)
+  for (node = screen->top;; node = node->next)
   {
-    fprintf(stderr,
-            "Error: Insufficient memory (attempt to calloc %lu bytes)\n",
-            (unsigned long int)size);
+    index_line((line_t *)node->data);
+    if (node == screen->bottom)
+      break;
+  }
+  index_token_end();
+
+  index_flush();
+  free(index_slots);
 
+  if (ferror(index_file) || fclose(index_file) != 0)
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, index_path, strerror(errno));
     exit(EXIT_FAILURE);
   }
-
-  return allocated;
 }
 
-/* ================== */
-/* Customized realloc */
-/* ================== */
-void *
-xrealloc(void * p, size_t size)
+/* ================================================================ */
+/* Append a slice of the payload of an OSC string to the one of the */
+/* current OSC string.                                              */
+/* ================================================================ */
+void
+osc_put(unsigned char * data, unsigned len)
 {
-  void * allocated;
-
-  allocated = realloc(p, size);
-  if (allocated == NULL && size > 0)
+  if (osc_len + len + 1 > osc_allocated)
   {
-    fprintf(stderr,
-            "Error: Insufficient memory (attempt to xrealloc %lu bytes)\n",
-            (unsigned long int)size);
-
-    exit(EXIT_FAILURE);
+    heap_charge(osc_len + len + 1 + 256 - osc_allocated);
+    osc_allocated = osc_len + len + 1 + 256;
+    osc           = xrealloc(osc, osc_allocated);
   }
 
-  return allocated;
+  memcpy(osc + osc_len, data, len);
+  osc_len += len;
 }
 
-/* =================================== */
-/* strdup implementation using xmalloc */
-/* =================================== */
-char *
-xstrdup(const char * p)
+/* ================================================================= */
+/* Interpret a complete OSC string "Ps;Pt", OSC 0 and 2 set the      */
+/* window title and OSC 8 (Pt is "params;uri") starts or ends (empty */
+/* uri) a hyperlink.                                                 */
+/* ================================================================= */
+void
+osc_dispatch(void)
 {
-  char * allocated;
+  char *   data;
+  char *   uri;
+  unsigned ps = 0;
 
-  allocated = xmalloc(strlen(p) + 1);
-  strcpy(allocated, p);
+  if (osc_len == 0)
+    return;
 
-  return allocated;
-}
+  osc[osc_len] = '\0'; /* osc_put always leaves room for it */
 
-/* ================================= */
-/* Print message about a bad option. */
-/* ================================= */
-static int
-badopt(const char * mess, int ch)
-{
-  if (my_opterr)
+  data = osc;
+  while (*data >= '0' && *data <= '9')
+    ps = ps * 10 + *data++ - '0';
+
+  if (*data++ != ';')
+    return;
+
+  switch (ps)
   {
-    fputs(prog, stderr);
-    fputs(mess, stderr);
-    (void)putc(ch, stderr);
-    (void)putc('\n', stderr);
+    case 0:
+    case 2:
+      if (title != NULL)
+        heap_release(strlen(title) + 1);
+      free(title);
+      heap_charge(strlen(data) + 1);
+      title = xstrdup(data);
+      break;
+
+    case 8:
+      uri = strchr(data, ';');
+      if (uri != NULL && *++uri != '\0')
+        link_intern(uri);
+      break;
   }
-  return ('?');
 }
 
-/* ========================================================================== */
-/* my_getopt - get option letter from argv                                    */
-/*                                                                            */
-/* This is a version of the public domain getopt() implementation by          */
-/* Henry Spencer, changed for 4.3BSD compatibility (in addition to System V). */
-/* It allows rescanning of an option list by setting optind to 0 before       */
-/* calling, which is why we use it even if the system has its own (in fact,   */
-/* this one has a unique name so as not to conflict with the system's).       */
-/* Thanks to Dennis Ferguson for the appropriate modifications.               */
-/*                                                                            */
-/* This file is in the Public Domain.                                         */
-/* ========================================================================== */
-static int
-my_getopt(int argc, char * argv[], const char * optstring)
+/* ============================================ */
+/* FNV-1a hash of the target of an OSC 8 link   */
+/* ============================================ */
+unsigned
+link_hash(const char * uri)
 {
-  register char         c;
-  register const char * place;
+  unsigned h = 2166136261u;
 
-  my_optarg = NULL;
+  while (*uri != '\0')
+    h = (h ^ (unsigned char)*uri++) * 16777619u;
 
-  if (my_optind == 0)
-  {
-    scan = NULL;
-    my_optind++;
-  }
+  return h;
+}
 
-  if (scan == NULL || *scan == '\0')
-  {
-    if (my_optind >= argc || argv[my_optind][0] != '-'
-        || argv[my_optind][1] == '\0')
-    {
-      return (EOF);
-    }
-    if (argv[my_optind][1] == '-' && argv[my_optind][2] == '\0')
+/* ================================================================ */
+/* Add the target of an OSC 8 link to the table of the links, if it */
+/* is not already there. See cluster_intern.                        */
+/* ================================================================ */
+void
+link_intern(const char * uri)
+{
+  unsigned   h, b, i, mask;
+  unsigned   old_len;
+  unsigned * old;
+
+  /* Keep the hash table at most half full */
+  /* """"""""""""""""""""""""""""""""""""" */
+  if (2 * (links_nb + 1) > links_buckets_len)
+  {
+    old     = links_buckets;
+    old_len = links_buckets_len;
+
+    links_buckets_len = old_len ? old_len * 2 : 64;
+    links_buckets     = xcalloc(links_buckets_len, sizeof(unsigned));
+    heap_charge(sizeof(unsigned) * (links_buckets_len - old_len));
+
+    mask = links_buckets_len - 1;
+    for (b = 0; b < old_len; b++)
     {
-      my_optind++;
-      return (EOF);
-    }
+      if (old[b] == 0)
+        continue;
 
-    scan = argv[my_optind++] + 1;
+      h = link_hash(links[old[b] - 1]) & mask;
+      while (links_buckets[h] != 0)
+        h = (h + 1) & mask;
+      links_buckets[h] = old[b];
+    }
+    free(old);
   }
 
-  c         = *scan++;
-  my_optopt = c & 0377;
-  for (place = optstring; place != NULL && *place != '\0'; ++place)
-    if (*place == c)
-      break;
-
-  if (place == NULL || *place == '\0' || c == ':' || c == '?')
+  mask = links_buckets_len - 1;
+  h    = link_hash(uri) & mask;
+  while ((i = links_buckets[h]) != 0)
   {
-    return (badopt(": unknown option -", c));
+    if (strcmp(links[i - 1], uri) == 0)
+      return;
+
+    h = (h + 1) & mask;
   }
 
-  place++;
-  if (*place == ':')
+  /* Not found, append it */
+  /* """""""""""""""""""" */
+  if (links_nb == links_allocated)
   {
-    if (*scan != '\0')
-    {
-      my_optarg = scan;
-      scan      = NULL;
-    }
-    else if (my_optind >= argc)
-    {
-      return (badopt(": option requires argument -", c));
-    }
-    else
-    {
-      my_optarg = argv[my_optind++];
-    }
+    heap_charge(sizeof(char *) * (links_allocated ? links_allocated : 64));
+    links_allocated = links_allocated ? links_allocated * 2 : 64;
+    links           = xrealloc(links, sizeof(char *) * links_allocated);
   }
 
-  return (c & 0377);
+  heap_charge(strlen(uri) + 1);
+  links[links_nb++] = xstrdup(uri);
+  links_buckets[h]  = links_nb;
 }
 
-/* ============================================== */
-/* Allocate and initialize a new line_t structure */
-/* ============================================== */
-line_t *
-line_new()
+/* ===================================================================t */
+/* Print the column and the attributes associated with the character at */
+/* column n of the current line.                                        */
+/* ===================================================================t */
+static int
+attrs_print(cell_t * cells, size_t n)
 {
-  line_t * line = xmalloc(sizeof(line_t));
+  size_t          i, offset;
+  attrs_bytes_t * v = cells[n].attrs;
 
-  line->allocated = 64;
-  line->length    = 0;
-  line->bytes     = 0;
-  line->string    = xmalloc(line->allocated);
-  *(line->string) = '\0';
+  if (v == NULL || cells[n].cp == WIDE_CONT)
+    return 0;
 
-  if (!no_attr)
-    line->attrs = xmalloc(sizeof(attrs_bytes_t *) * 64);
+  offset = memspn(v->bytes, v->len, "\0", 1);
+  if (offset == v->len && v->fg == 0 && v->bg == 0)
+    return 0;
 
-  return line;
+  fprintf(output, "%d:", n);
+  for (i = offset; i < v->len; i++)
+    fprintf(output, "%02x", v->bytes[i]);
+  color_print(38, v->fg);
+  color_print(48, v->bg);
+  fputs(" ", output);
+
+  return 0;
 }
 
-/* ================================================ */
-/* Allocate and initialize a new screen_t structure */
-/* ================================================ */
+/* ================================================================ */
+/* Print an extended color as its SGR sub-parameters, for example   */
+/* ,38:2:255:128:0 for an orange foreground.                        */
+/* ================================================================ */
 void
-screen_init(screen_t * s, unsigned height_opt)
+color_print(unsigned sgr, unsigned color)
 {
-  unsigned i;
-  line_t * line;
-
-  s->column = 0;
-  s->lines  = ll_new();
-
-  for (i = 0; i < height_opt; i++)
-  {
-    line = line_new();
-    ll_append(s->lines, line);
-  }
-
-  s->top          = s->lines->head;
-  s->bottom       = s->lines->tail;
-  s->current      = s->top;
-  s->saved_row    = 0;
-  s->saved_column = 0;
+  if (color & COLOR_INDEXED)
+    fprintf(output, ",%u:5:%u", sgr, color & 0xff);
+  else if (color & COLOR_RGB)
+    fprintf(output, ",%u:2:%u:%u:%u", sgr, (color >> 16) & 0xff,
+            (color >> 8) & 0xff, color & 0xff);
 }
 
-/* ============================================================ */
-/* Counts the number of UTF-8 character in a byte stream before */
-/* reaching a given column * (included).                        */
-/* OUT: the byte position correspnding to the given column      */
-/* ============================================================ */
+/* ================================================================== */
+/* Decode the extended color whose SGR parameter (38 or 48) is at     */
+/* index i, either in the ';' form (38;5;n or 38;2;r;g;b) or in the   */
+/* ':' form (38:5:n, 38:2:r:g:b or 38:2:cs:r:g:b).                    */
+/* OUT: color receives the color or 0 if it is not valid.             */
+/* Returns the index of the first parameter after the color.          */
+/* ================================================================== */
 unsigned
-find_nth_char(unsigned char * str, unsigned len, unsigned column,
-              unsigned * pos)
+sgr_color(vtparse_t * parser, unsigned i, unsigned * color)
 {
-  unsigned n = 0;
-  unsigned p;
+  unsigned short * p = parser->params;
+  unsigned         n = parser->num_params;
+  unsigned         args = 0;
+  unsigned         c;
 
-  for (p = 0; p < len; p++)
-  {
-    if (n == column)
-      break;
+  *color = 0;
+
+  /* Number of arguments of the color */
+  /* """""""""""""""""""""""""""""""" */
+  while (i + 1 + args < n && (parser->subparams & (1u << (i + 1 + args))))
+    args++;
 
-    if (str[p] <= 0x7f)
-      goto next;
-    if (str[p] >= 0xc2 && str[p] <= 0xdf)
-      p++;
-    else if (str[p] >= 0xe0 && str[p] <= 0xef)
-      p += 2;
-    else if (str[p] >= 0xf0 && str[p] <= 0xf4)
-      p += 3;
+  if (args == 0)
+  {
+    /* ';' form */
+    /* """""""" */
+    if (i + 1 < n && p[i + 1] == 5)
+      args = 2;
+    else if (i + 1 < n && p[i + 1] == 2)
+      args = 4;
     else
-      continue;
+      return i + 1;
 
-  next:
-    n++;
+    if (i + args >= n)
+      return n;
   }
 
-  *pos = p;
+  c = i + 2;
+  if (p[i + 1] == 5 && args >= 2)
+    *color = COLOR_INDEXED | (p[c] > 255 ? 255 : p[c]);
+  else if (p[i + 1] == 2 && args >= 4)
+  {
+    if (args >= 5) /* skip the color space id */
+      c++;
+    *color = COLOR_RGB | (p[c] > 255 ? 255 : p[c]) << 16
+             | (p[c + 1] > 255 ? 255 : p[c + 1]) << 8
+             | (p[c + 2] > 255 ? 255 : p[c + 2]);
+  }
 
-  return n;
+  return i + 1 + args;
 }
 
-/* ===================================================== */
-/* Callback function called for each DEC decoded element */
-/* ===================================================== */
-void
-parser_callback(vtparse_t * parser, vtparse_action_t action, unsigned char ch)
+/* ======================================================= */
+/* Merge two sorted arrays, first_a with a integers and    */
+/* second_a with b integers, into a sorted array result_a. */
+/* Duplicated values are removed.                          */
+/* ======================================================= */
+int
+attrs_merge(unsigned char * first_a, int a, unsigned char * second_a, int b,
+            unsigned char * result_a)
 {
-  line_t *        cl;
-  ll_node_t *     node;
-  unsigned        i;
-  static unsigned ch_bytes = 1;
-  static unsigned rem_bytes;
+  int           i, j, k;
+  unsigned char old;
 
-  /* Lengh in bytes of the utf-8 character introduced by ch */
-  /* """""""""""""""""""""""""""""""""""""""""""""""""""""" */
-  if (ch <= 0x7f)
-  {
-    ch_bytes  = 1;
-    rem_bytes = 0;
-  }
-  else if (rem_bytes == 0 && ch >= 0xc2 && ch <= 0xdf)
-  {
-    ch_bytes  = 2;
-    rem_bytes = 1;
-  }
-  else if (rem_bytes == 0 && ch >= 0xe0 && ch <= 0xef)
+  i   = 0;
+  j   = 0;
+  k   = 0;
+  old = '\0';
+
+  while (i < a && j < b)
   {
-    ch_bytes  = 3;
-    rem_bytes = 2;
+    if (first_a[i] <= second_a[j])
+    {
+      /* copy first_a[i] to result_a[k] and move */
+      /* the pointer i and k forward             */
+      /* """"""""""""""""""""""""""""""""""""""" */
+      if (first_a[i] != old)
+        old = result_a[k++] = first_a[i];
+      i++;
+    }
+    else
+    {
+      /* copy second_a[j] to result_a[k] and move */
+      /* the pointer j and k forward              */
+      /* """""""""""""""""""""""""""""""""""""""" */
+      if (second_a[j] != old)
+        old = result_a[k++] = second_a[j];
+      j++;
+    }
   }
-  else if (rem_bytes == 0 && ch >= 0xf0 && ch <= 0xf4)
+  /* move the remaining elements in first_a into result_a */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""" */
+  while (i < a)
   {
-    ch_bytes  = 4;
-    rem_bytes = 3;
+    if (first_a[i] != old)
+      old = result_a[k++] = first_a[i];
+    i++;
   }
-  else if (rem_bytes > 0 && ch >= 0x80 && ch <= 0xbf)
-    rem_bytes--;
-  else /* invalid */
+  /* move the remaining elements in second_a into result_a */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
+  while (j < b)
   {
-    ch_bytes = rem_bytes = 1;
-    rem_bytes            = 0;
-    ch                   = '?';
+    if (second_a[j] != old)
+      old = result_a[k++] = second_a[j];
+    j++;
   }
 
-  switch (action)
-  {
-    attrs_bytes_t * attrs;
+  return k;
+}
 
-    case VTPARSE_ACTION_PRINT:
-      /* TODO: manage 0x7f (DEL) */
-      /* """"""""""""""""""""""" */
-      cl = (line_t *)screen.current->data;
+/* ********************* */
+/* Linked List functions */
+/* ********************* */
 
-      if (cl->bytes == cl->allocated - 1)
-      {
-        cl->allocated += 64;
-        cl->string = xrealloc(cl->string, cl->allocated);
-      }
+/* ======================== */
+/* Create a new linked list */
+/* ======================== */
+ll_t *
+ll_new(void)
+{
+  ll_t * ret = xmalloc(sizeof(ll_t));
+  ll_init(ret);
 
-      /* We need to add spaces at the end of the line if the column to */
-      /* write is after it.                                            */
-      /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-      if (screen.column >= cl->length)
-      {
-        if (!no_attr)
-          cl->attrs = xrealloc(cl->attrs, 64 * sizeof(attrs_bytes_t *)
-                                            * (screen.column / 64 + 1));
+  return ret;
+}
 
-        for (i = 0; i < screen.column - cl->length; i++)
-        {
-          if (cl->bytes + i == cl->allocated - 2)
-          {
-            cl->allocated += 64;
-            cl->string = xrealloc(cl->string, cl->allocated);
-          }
-          *(cl->string + cl->bytes + i) = ' ';
+/* ======================== */
+/* Initialize a linked list */
+/* ======================== */
+void
+ll_init(ll_t * list)
+{
+  list->head = NULL;
+  list->tail = NULL;
+  list->len  = 0;
+}
 
-          if (!no_attr)
-          {
-            attrs                     = xmalloc(sizeof(attrs_bytes_t));
-            attrs->len                = 1;
-            attrs->bytes              = xmalloc(1);
-            *attrs->bytes             = '\0';
-            cl->attrs[cl->length + i] = attrs;
-          }
-        }
+/* ==================================================== */
+/* Allocate the space for a new node in the linked list */
+/* ==================================================== */
+ll_node_t *
+ll_new_node(void)
+{
+  ll_node_t * ret;
 
-        cl->length += i;
-        cl->bytes += i;
-      }
+  if (arena.nodes != NULL)
+  {
+    ret         = (ll_node_t *)arena.nodes;
+    arena.nodes = arena.nodes->next;
+  }
+  else
+    ret = arena_alloc(sizeof(ll_node_t));
 
-      if (!no_attr)
-      {
-        attrs        = xmalloc(sizeof(attrs_bytes_t));
-        attrs->len   = curr_attrs_bytes.len;
-        attrs->bytes = xmalloc(attrs->len);
+  return ret;
+}
 
-        for (i = 0; i < attrs->len; i++)
-          attrs->bytes[i] = curr_attrs_bytes.bytes[i];
-      }
+/* =============================================================== */
+/* Give back a node removed from a linked list, it will be reused. */
+/* =============================================================== */
+void
+ll_free_node(ll_node_t * node)
+{
+  arena_block_t * block = (arena_block_t *)node;
 
-      /* if we are at the end of the current line, increase its size */
-      /* by 1 and if the UTF-8 character is complete, add 1 to the   */
-      /* logical length of the line and the column.                  */
-      /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-      if (screen.column == cl->length)
-      {
-        *(cl->string + cl->bytes) = ch;
-        cl->bytes++;
-        *(cl->string + cl->bytes) = '\0';
+  block->next = arena.nodes;
+  arena.nodes = block;
+}
 
-        if (rem_bytes == 0) /* A complete UTF-8 sequence has been read */
-        {
-          if (!no_attr && attrs->len > 0)
-            cl->attrs[screen.column] = attrs;
+/* ==================================================================== */
+/* Append a new node filled with its data at the end of the linked list */
+/* The user is responsible for the memory management of the data        */
+/* ==================================================================== */
+int
+ll_append(ll_t * const list, void * const data)
+{
+  int         ret = 1;
+  ll_node_t * node;
 
-          cl->length++;
-          screen.column++;
-        }
-      }
+  if (list)
+  {
+    node = ll_new_node();
+    if (node)
+    {
+      node->data = data;
+      node->next = NULL;
 
-      /* We are in the middle of an existing line, we need to find the */
-      /* offset of the possible UTF-8 character at the current column, */
-      /* before writing it.                                            */
-      /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+      node->prev = list->tail;
+      if (list->tail)
+        list->tail->next = node;
       else
-      {
-        unsigned pos;
+        list->head = node;
 
-        (void)find_nth_char(cl->string, cl->bytes, screen.column, &pos);
-        *(cl->string + pos + ch_bytes - rem_bytes - 1) = ch;
+      list->tail = node;
 
-        if (rem_bytes == 0)
-        {
-          if (!no_attr && attrs->len > 0)
-          {
-            attrs_bytes_t * old_attrs;
+      ++list->len;
+      ret = 0;
+    }
+  }
 
-            old_attrs = cl->attrs[screen.column];
-            free(old_attrs->bytes);
-            free(old_attrs);
+  return ret;
+}
 
-            cl->attrs[screen.column] = attrs;
-          }
+/* =================================================================== */
+/* Put a new node filled with its data at the beginning of the linked  */
+/* list. The user is responsible for the memory management of the data */
+/* =================================================================== */
+int
+ll_prepend(ll_t * const list, void * const data)
+{
+  int         ret = 1;
+  ll_node_t * node;
 
-          screen.column++;
-          if (pos + ch_bytes - rem_bytes - 1 > cl->bytes)
-            cl->bytes = pos + ch_bytes - rem_bytes;
-        }
-      }
-      break;
+  if (list)
+  {
+    node = ll_new_node();
+    if (node)
+    {
+      node->data = data;
+      node->prev = NULL;
+
+      node->next = list->head;
+      if (list->head)
+        list->head->prev = node;
+      else
+        list->tail = node;
+
+      list->head = node;
+
+      ++list->len;
+      ret = 0;
+    }
+  }
+
+  return ret;
+}
+
+/* ======================================================= */
+/* Insert a new node before the specified node in the list */
+/* ======================================================= */
+void
+ll_insert_before(ll_t * const list, ll_node_t * node, void * const data)
+{
+  ll_node_t * new_node;
+
+  if (list)
+  {
+    if (node->prev == NULL)
+      ll_prepend(list, data);
+    else
+    {
+      new_node = ll_new_node();
+      if (new_node)
+      {
+        new_node->data   = data;
+        new_node->next   = node;
+        new_node->prev   = node->prev;
+        node->prev->next = new_node;
+        node->prev       = new_node;
+
+        ++list->len;
+      }
+    }
+  }
+}
+
+/* ====================================================== */
+/* Insert a new node after the specified node in the list */
+/* ====================================================== */
+void
+ll_insert_after(ll_t * const list, ll_node_t * node, void * const data)
+{
+  ll_node_t * new_node;
+
+  if (list)
+  {
+    if (node->next == NULL)
+      ll_append(list, data);
+    else
+    {
+      new_node = ll_new_node();
+      if (new_node)
+      {
+        new_node->data   = data;
+        new_node->prev   = node;
+        new_node->next   = node->next;
+        node->next->prev = new_node;
+        node->next       = new_node;
+
+        ++list->len;
+      }
+    }
+  }
+}
+
+/* ================================ */
+/* Remove a node from a linked list */
+/* ================================ */
+int
+ll_delete(ll_t * const list, ll_node_t * node)
+{
+  if (list->head == list->tail)
+  {
+    if (list->head != NULL)
+      list->head = list->tail = NULL;
+    else
+      return 0;
+  }
+  else if (node->prev == NULL)
+  {
+    list->head       = node->next;
+    list->head->prev = NULL;
+  }
+  else if (node->next == NULL)
+  {
+    list->tail       = node->prev;
+    list->tail->next = NULL;
+  }
+  else
+  {
+    node->next->prev = node->prev;
+    node->prev->next = node->next;
+  }
+
+  --list->len;
+
+  return 1;
+}
+
+/* ================================================================= */
+/* Unlink the chain of nodes from first to last (included) from the  */
+/* list without freeing them. The chain itself is left untouched.    */
+/* ================================================================= */
+void
+ll_unlink_chain(ll_t * const list, ll_node_t * first, ll_node_t * last)
+{
+  if (first->prev)
+    first->prev->next = last->next;
+  else
+    list->head = last->next;
+
+  if (last->next)
+    last->next->prev = first->prev;
+  else
+    list->tail = first->prev;
+}
+
+/* ================================================================= */
+/* Move the chain of nodes from first to last (included) before node */
+/* node must not be part of the chain.                               */
+/* ================================================================= */
+void
+ll_move_before(ll_t * const list, ll_node_t * first, ll_node_t * last,
+               ll_node_t * node)
+{
+  ll_unlink_chain(list, first, last);
+
+  first->prev = node->prev;
+  last->next  = node;
+
+  if (node->prev)
+    node->prev->next = first;
+  else
+    list->head = first;
+
+  node->prev = last;
+}
+
+/* ================================================================ */
+/* Move the chain of nodes from first to last (included) after node */
+/* node must not be part of the chain.                              */
+/* ================================================================ */
+void
+ll_move_after(ll_t * const list, ll_node_t * first, ll_node_t * last,
+              ll_node_t * node)
+{
+  ll_unlink_chain(list, first, last);
+
+  last->next  = node->next;
+  first->prev = node;
+
+  if (node->next)
+    node->next->prev = last;
+  else
+    list->tail = last;
+
+  node->next = first;
+}
+
+/* *************************** */
+/* Memory allocation functions */
+/* *************************** */
+
+/* Created by Kevin Locke (from numerous canonical examples)         */
+/*                                                                   */
+/* I hereby place this file in the public domain.  It may be freely  */
+/* reproduced, distributed, used, modified, built upon, or otherwise */
+/* employed by anyone for any purpose without restriction.           */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+
+/* ================= */
+/* Customized malloc */
+/* ================= */
+void *
+xmalloc(size_t size)
+{
+  void * allocated;
+  size_t real_size;
+
+  real_size = (size > 0) ? size : 1;
+  allocated = malloc(real_size);
+  STAT_ADD(allocs, 1);
+  STAT_ADD(alloc_bytes, real_size);
+  if (allocated == NULL)
+  {
+    fprintf(stderr,
+            "Error: Insufficient memory (attempt to malloc %lu bytes)\n",
+            (unsigned long int)size);
+
+    exit(EXIT_FAILURE);
+  }
+
+  return allocated;
+}
+
+/* ================= */
+/* Customized calloc */
+/* ================= */
+void *
+xcalloc(size_t n, size_t size)
+{
+  void * allocated;
+
+  n         = (n > 0) ? n : 1;
+  size      = (size > 0) ? size : 1;
+  allocated = calloc(n, size);
+  STAT_ADD(allocs, 1);
+  STAT_ADD(alloc_bytes, n * size);
+  if (allocated == NULL)
+  {
+    fprintf(stderr,
+            "Error: Insufficient memory (attempt to calloc %lu bytes)\n",
+            (unsigned long int)size);
+
+    exit(EXIT_FAILURE);
+  }
+
+  return allocated;
+}
+
+/* ================== */
+/* Customized realloc */
+/* ================== */
+void *
+xrealloc(void * p, size_t size)
+{
+  void * allocated;
+
+  allocated = realloc(p, size);
+  STAT_ADD(allocs, 1);
+  STAT_ADD(alloc_bytes, size);
+  if (allocated == NULL && size > 0)
+  {
+    fprintf(stderr,
+            "Error: Insufficient memory (attempt to xrealloc %lu bytes)\n",
+            (unsigned long int)size);
+
+    exit(EXIT_FAILURE);
+  }
+
+  return allocated;
+}
+
+/* =================================== */
+/* strdup implementation using xmalloc */
+/* =================================== */
+char *
+xstrdup(const char * p)
+{
+  char * allocated;
+
+  allocated = xmalloc(strlen(p) + 1);
+  strcpy(allocated, p);
+
+  return allocated;
+}
+
+/* ================================================================= */
+/* Carve size bytes from the session arena. A block too large to fit */
+/* in the remaining part of the current chunk gets its own chunk if  */
+/* it is bigger than a quarter of a chunk, so that the current chunk */
+/* is not wasted.                                                    */
+/* ================================================================= */
+void *
+arena_alloc(size_t size)
+{
+  arena_chunk_t * chunk;
+  size_t          header = ARENA_ROUND(sizeof(arena_chunk_t));
+  void *          block;
+
+  size = ARENA_ROUND(size > 0 ? size : 1);
+
+  if (size > arena.left)
+  {
+    if (size > ARENA_CHUNK / 4)
+    {
+      chunk       = xmalloc(header + size);
+      chunk->size = header + size;
+      heap_charge(chunk->size);
+
+      if (arena.chunks == NULL)
+      {
+        chunk->next  = NULL;
+        arena.chunks = chunk;
+      }
+      else
+      {
+        chunk->next         = arena.chunks->next;
+        arena.chunks->next = chunk;
+      }
+
+      return (char *)chunk + header;
+    }
+
+    chunk        = xmalloc(header + ARENA_CHUNK);
+    chunk->size  = header + ARENA_CHUNK;
+    chunk->next  = arena.chunks;
+    arena.chunks = chunk;
+    arena.next   = (char *)chunk + header;
+    arena.left   = ARENA_CHUNK;
+    heap_charge(chunk->size);
+  }
+
+  block = arena.next;
+  arena.next += size;
+  arena.left -= size;
+
+  return block;
+}
+
+/* ============================================================ */
+/* Release all the chunks of the session arena at once, all the */
+/* lines, nodes and attributes carved from them become invalid. */
+/* ============================================================ */
+void
+arena_release(void)
+{
+  arena_chunk_t * chunk;
+
+  while ((chunk = arena.chunks) != NULL)
+  {
+    arena.chunks = chunk->next;
+    heap_release(chunk->size);
+    free(chunk);
+  }
+
+  memset(&arena, 0, sizeof(arena));
+}
+
+/* ================================================================= */
+/* Return the size class of an array of at least cells cells, class */
+/* k holds CELLS_MIN << k cells.                                     */
+/* ================================================================= */
+unsigned
+cells_class(unsigned cells)
+{
+  unsigned class = 0;
+
+  while (class < CELL_CLASSES - 1 && (CELLS_MIN << class) < cells)
+    class++;
+
+  return class;
+}
+
+/* ================================================================= */
+/* Get an array of CELLS_MIN << class cells, a freed one if possible */
+/* ================================================================= */
+cell_t *
+cells_alloc(unsigned class)
+{
+  cell_t * cells;
+
+  if (arena.cells[class] != NULL)
+  {
+    cells              = (cell_t *)arena.cells[class];
+    arena.cells[class] = arena.cells[class]->next;
+  }
+  else
+    cells = arena_alloc(sizeof(cell_t) * (CELLS_MIN << class));
+
+  return cells;
+}
+
+/* ======================================================== */
+/* Give back an array of cells to the free list of its size */
+/* class.                                                   */
+/* ======================================================== */
+void
+cells_free(cell_t * cells, unsigned allocated)
+{
+  arena_block_t * block = (arena_block_t *)cells;
+  unsigned        class = cells_class(allocated);
+
+  block->next        = arena.cells[class];
+  arena.cells[class] = block;
+}
+
+/* ================================= */
+/* Print message about a bad option. */
+/* ================================= */
+static int
+badopt(const char * mess, int ch)
+{
+  if (my_opterr)
+  {
+    fputs(prog, stderr);
+    fputs(mess, stderr);
+    (void)putc(ch, stderr);
+    (void)putc('\n', stderr);
+  }
+  return ('?');
+}
+
+/* ========================================================================== */
+/* my_getopt - get option letter from argv                                    */
+/*                                                                            */
+/* This is a version of the public domain getopt() implementation by          */
+/* Henry Spencer, changed for 4.3BSD compatibility (in addition to System V). */
+/* It allows rescanning of an option list by setting optind to 0 before       */
+/* calling, which is why we use it even if the system has its own (in fact,   */
+/* this one has a unique name so as not to conflict with the system's).       */
+/* Thanks to Dennis Ferguson for the appropriate modifications.               */
+/*                                                                            */
+/* This file is in the Public Domain.                                         */
+/* ========================================================================== */
+static int
+my_getopt(int argc, char * argv[], const char * optstring)
+{
+  register char         c;
+  register const char * place;
+
+  my_optarg = NULL;
+
+  if (my_optind == 0)
+  {
+    scan = NULL;
+    my_optind++;
+  }
+
+  if (scan == NULL || *scan == '\0')
+  {
+    if (my_optind >= argc || argv[my_optind][0] != '-'
+        || argv[my_optind][1] == '\0')
+    {
+      return (EOF);
+    }
+    if (argv[my_optind][1] == '-' && argv[my_optind][2] == '\0')
+    {
+      my_optind++;
+      return (EOF);
+    }
+
+    scan = argv[my_optind++] + 1;
+  }
+
+  c         = *scan++;
+  my_optopt = c & 0377;
+  for (place = optstring; place != NULL && *place != '\0'; ++place)
+    if (*place == c)
+      break;
+
+  if (place == NULL || *place == '\0' || c == ':' || c == '?')
+  {
+    return (badopt(": unknown option -", c));
+  }
+
+  place++;
+  if (*place == ':')
+  {
+    if (*scan != '\0')
+    {
+      my_optarg = scan;
+      scan      = NULL;
+    }
+    else if (my_optind >= argc)
+    {
+      return (badopt(": option requires argument -", c));
+    }
+    else
+    {
+      my_optarg = argv[my_optind++];
+    }
+  }
+
+  return (c & 0377);
+}
+
+/* ============================================== */
+/* Allocate and initialize a new line_t structure */
+/* ============================================== */
+line_t *
+line_new()
+{
+  line_t * line;
+
+  if (arena.lines != NULL)
+  {
+    line        = (line_t *)arena.lines;
+    arena.lines = arena.lines->next;
+  }
+  else
+    line = arena_alloc(sizeof(line_t));
+
+  /* The cells are only allocated when the line is first written */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  line->allocated = 0;
+  line->length    = 0;
+  line->wrapped   = 0;
+  line->refs      = 1;
+  line->hashed    = 0;
+  line->cells     = NULL;
+
+  return line;
+}
+
+/* ================================================================ */
+/* Returns the line of a node ready to be modified, a row which was */
+/* still sharing the blank line gets its own line, and a line also  */
+/* held by a snapshot is copied first.                              */
+/* ================================================================ */
+line_t *
+line_touch(ll_node_t * node)
+{
+  line_t * line = (line_t *)node->data;
+  line_t * copy;
+
+  if (line == &blank_line)
+    node->data = line_new();
+  else if (line->refs > 1)
+  {
+    copy = line_new();
+    if (line->length > 0)
+    {
+      line_reserve(copy, line->length);
+      memcpy(copy->cells, line->cells, sizeof(cell_t) * line->length);
+    }
+    copy->length  = line->length;
+    copy->wrapped = line->wrapped;
+
+    line->refs--;
+    node->data = copy;
+  }
+
+  /* The line is about to change */
+  /* """"""""""""""""""""""""""" */
+  line         = (line_t *)node->data;
+  line->hashed = 0;
+
+  return line;
+}
+
+/* ================================================================ */
+/* Empty the line of a row. A shared line is left as is and the row */
+/* goes back to the blank line.                                     */
+/* ================================================================ */
+void
+row_clear(ll_node_t * node)
+{
+  line_t * line = (line_t *)node->data;
+
+  if (line != &blank_line && line->refs > 1)
+  {
+    line->refs--;
+    node->data = &blank_line;
+  }
+  else
+    line_clear(line);
+}
+
+/* ============================================================== */
+/* Drop a reference on a line. The last one gives the line_t      */
+/* structure and its content back to the free lists of the arena. */
+/* ============================================================== */
+void
+line_release(line_t * line)
+{
+  arena_block_t * block = (arena_block_t *)line;
+
+  if (line == &blank_line || --line->refs > 0)
+    return;
+
+  if (line->allocated > 0)
+    cells_free(line->cells, line->allocated);
+
+  block->next = arena.lines;
+  arena.lines = block;
+}
+
+/* ======================================= */
+/* Empty a line, its cells are kept for    */
+/* later use.                              */
+/* ======================================= */
+void
+line_clear(line_t * line)
+{
+  if (line == &blank_line)
+    return;
+
+  line->length  = 0;
+  line->wrapped = 0;
+  line->hashed  = 0;
+}
+
+/* ============================================================= */
+/* Make sure that the line has room for at least cells cells.    */
+/* The cells are moved to an array of the next fitting size      */
+/* class and the old array is given back to the arena. When the  */
+/* number of columns is limited, the first array holds them all. */
+/* ============================================================= */
+void
+line_reserve(line_t * line, unsigned cells)
+{
+  unsigned class;
+  cell_t * new_cells;
+
+  if (cells <= line->allocated)
+    return;
+
+  if (line->allocated == 0 && width > cells)
+    cells = width;
+
+  class     = cells_class(cells);
+  new_cells = cells_alloc(class);
+  if (line->allocated > 0)
+  {
+    memcpy(new_cells, line->cells, sizeof(cell_t) * line->allocated);
+    cells_free(line->cells, line->allocated);
+    STAT_ADD(cell_moves, 1);
+    STAT_ADD(cells_moved, line->allocated);
+  }
+
+  line->allocated = CELLS_MIN << class;
+  line->cells     = new_cells;
+}
+
+/* ================================================================ */
+/* Fill the cells of a line from column from (included) to column  */
+/* to (excluded) with spaces without attributes.                    */
+/* The cells must have already been reserved.                       */
+/* ================================================================ */
+void
+line_blank(line_t * line, unsigned from, unsigned to)
+{
+  cell_t * cell;
+
+  for (cell = line->cells + from; cell < line->cells + to; cell++)
+  {
+    cell->cp    = ' ';
+    cell->attrs = NULL;
+  }
+}
+
+/* ================================================================= */
+/* Called before the cells on one side of the left edge of column    */
+/* are modified. A wide character crossing this edge would lose one  */
+/* of its halves, it is replaced by two blanks.                      */
+/* ================================================================= */
+void
+line_split_wide(line_t * line, unsigned column)
+{
+  if (column > 0 && column < line->length
+      && line->cells[column].cp == WIDE_CONT)
+    line_blank(line, column - 1, column + 1);
+}
+
+/* ================================================================= */
+/* Write n copies of a character using w cells (2 for a wide one) in */
+/* a line starting at a given column.                                */
+/* The line is padded with spaces if the column is after its end.    */
+/* ================================================================= */
+void
+line_write(line_t * line, unsigned column, cell_t * cells, unsigned w,
+           unsigned n)
+{
+  unsigned i;
+  unsigned end = column + w * n;
+
+  line_reserve(line, end);
+
+  if (column > line->length)
+    line_blank(line, line->length, column);
+  else
+  {
+    line_split_wide(line, column);
+    line_split_wide(line, end);
+  }
+
+  for (i = column; i < end; i += w)
+    memcpy(line->cells + i, cells, sizeof(cell_t) * w);
+
+  if (end > line->length)
+    line->length = end;
+}
+
+/* ================================================================= */
+/* Insert n blank cells at a given column, the cells at the right of */
+/* this column are shifted in a single move. Nothing is done if the  */
+/* column is after the end of the line as blanks are implicit there. */
+/* The cells pushed after the last column are lost when the number   */
+/* of columns is limited.                                            */
+/* ================================================================= */
+void
+line_insert(line_t * line, unsigned column, unsigned n)
+{
+  unsigned length;
+
+  if (column >= line->length)
+    return;
+
+  line_split_wide(line, column);
+
+  length = line->length + n;
+  if (width)
+  {
+    if (n > width - column)
+      n = width - column;
+    length = line->length + n > width ? width : line->length + n;
+    line_split_wide(line, width - n);
+  }
+
+  line_reserve(line, length);
+  memmove(line->cells + column + n, line->cells + column,
+          sizeof(cell_t) * (length - column - n));
+  STAT_ADD(cell_moves, 1);
+  STAT_ADD(cells_moved, length - column - n);
+  line_blank(line, column, column + n);
+
+  line->length = length;
+}
+
+/* ================================================================ */
+/* Delete n cells at a given column, the cells at the right of the  */
+/* deleted ones are shifted to the left in a single move.           */
+/* ================================================================ */
+void
+line_delete(line_t * line, unsigned column, unsigned n)
+{
+  if (column >= line->length)
+    return;
+
+  if (n > line->length - column)
+    n = line->length - column;
+
+  line_split_wide(line, column);
+  line_split_wide(line, column + n);
+
+  memmove(line->cells + column, line->cells + column + n,
+          sizeof(cell_t) * (line->length - column - n));
+  STAT_ADD(cell_moves, 1);
+  STAT_ADD(cells_moved, line->length - column - n);
+
+  line->length -= n;
+}
+
+/* ============================================ */
+/* FNV-1a hash of a sequence of code points     */
+/* ============================================ */
+unsigned
+cluster_hash(unsigned * cps, unsigned n)
+{
+  unsigned h = 2166136261u;
+  unsigned i;
+
+  for (i = 0; i < n; i++)
+    h = (h ^ cps[i]) * 16777619u;
+
+  return h;
+}
+
+/* ================================================================= */
+/* Returns the code points of the character stored in *cp, which can */
+/* be a single code point or a cluster index.                        */
+/* OUT: n receives the number of code points.                        */
+/* The result is only valid until the next cluster_intern call.      */
+/* ================================================================= */
+unsigned *
+cluster_get(unsigned * cp, unsigned * n)
+{
+  unsigned i;
+
+  if (!(*cp & CLUSTER_TAG))
+  {
+    *n = 1;
+    return cp;
+  }
+
+  i  = *cp & ~CLUSTER_TAG;
+  *n = clusters.starts[i + 1] - clusters.starts[i];
+
+  return clusters.cps + clusters.starts[i];
+}
+
+/* ================================================================ */
+/* Find a cluster of n code points in the cluster table, or add it. */
+/* Returns the value to store in a cell to reference it.            */
+/* ================================================================ */
+unsigned
+cluster_intern(unsigned * cps, unsigned n)
+{
+  unsigned   h, b, i, mask;
+  unsigned   old_len;
+  unsigned * old;
+
+  /* Keep the hash table at most half full */
+  /* """"""""""""""""""""""""""""""""""""" */
+  if (2 * (clusters.count + 1) > clusters.buckets_len)
+  {
+    old     = clusters.buckets;
+    old_len = clusters.buckets_len;
+
+    clusters.buckets_len = old_len ? old_len * 2 : 256;
+    clusters.buckets     = xcalloc(clusters.buckets_len, sizeof(unsigned));
+    heap_charge(sizeof(unsigned) * (clusters.buckets_len - old_len));
+
+    mask = clusters.buckets_len - 1;
+    for (b = 0; b < old_len; b++)
+    {
+      if (old[b] == 0)
+        continue;
+
+      i = old[b] - 1;
+      h = cluster_hash(clusters.cps + clusters.starts[i],
+                       clusters.starts[i + 1] - clusters.starts[i])
+          & mask;
+      while (clusters.buckets[h] != 0)
+        h = (h + 1) & mask;
+      clusters.buckets[h] = old[b];
+    }
+    free(old);
+  }
+
+  mask = clusters.buckets_len - 1;
+  h    = cluster_hash(cps, n) & mask;
+  while ((i = clusters.buckets[h]) != 0)
+  {
+    i--;
+    if (clusters.starts[i + 1] - clusters.starts[i] == n
+        && memcmp(clusters.cps + clusters.starts[i], cps,
+                  sizeof(unsigned) * n)
+             == 0)
+      return CLUSTER_TAG | i;
+
+    h = (h + 1) & mask;
+  }
+
+  /* Not found, append it */
+  /* """""""""""""""""""" */
+  if (clusters.count + 2 > clusters.allocated)
+  {
+    heap_charge(sizeof(unsigned)
+                * (clusters.allocated ? clusters.allocated : 256));
+    clusters.allocated = clusters.allocated ? clusters.allocated * 2 : 256;
+    clusters.starts    = xrealloc(clusters.starts,
+                               sizeof(unsigned) * clusters.allocated);
+    clusters.starts[0] = 0;
+  }
+
+  if (clusters.cps_len + n > clusters.cps_allocated)
+  {
+    heap_charge(sizeof(unsigned)
+                * ((clusters.cps_len + n) * 2 - clusters.cps_allocated));
+    clusters.cps_allocated = (clusters.cps_len + n) * 2;
+    clusters.cps           = xrealloc(clusters.cps,
+                            sizeof(unsigned) * clusters.cps_allocated);
+  }
+
+  memcpy(clusters.cps + clusters.cps_len, cps, sizeof(unsigned) * n);
+  clusters.cps_len += n;
+
+  clusters.starts[clusters.count + 1] = clusters.cps_len;
+  clusters.buckets[h]                 = clusters.count + 1;
+
+  return CLUSTER_TAG | clusters.count++;
+}
+
+/* ============================================================== */
+/* Add a code point to the character of a cell, the new character */
+/* is a cluster.                                                  */
+/* ============================================================== */
+void
+cell_attach(cell_t * cell, unsigned cp)
+{
+  unsigned   buf[CLUSTER_MAX];
+  unsigned * cps;
+  unsigned   n;
+
+  cps = cluster_get(&cell->cp, &n);
+  if (n == CLUSTER_MAX)
+    return;
+
+  memcpy(buf, cps, sizeof(unsigned) * n);
+  buf[n++] = cp;
+
+  cell->cp = cluster_intern(buf, n);
+}
+
+/* ================================================================= */
+/* Returns the cell containing the character before a column (the    */
+/* first cell of a wide character) or NULL if there is none.         */
+/* ================================================================= */
+cell_t *
+line_cell_before(line_t * line, unsigned column)
+{
+  if (column == 0 || column > line->length)
+    return NULL;
+
+  column--;
+  if (line->cells[column].cp == WIDE_CONT && column > 0)
+    column--;
+
+  return line->cells + column;
+}
+
+/* ================================================ */
+/* Allocate and initialize a new screen_t structure */
+/* ================================================ */
+void
+screen_init(screen_t * s, unsigned height_opt)
+{
+  unsigned i;
+
+  s->column = 0;
+  s->lines  = ll_new();
+
+  /* All the rows start as the shared blank line */
+  /* """"""""""""""""""""""""""""""""""""""""""" */
+  for (i = 0; i < height_opt; i++)
+    ll_append(s->lines, &blank_line);
+
+  s->top          = s->lines->head;
+  s->bottom       = s->lines->tail;
+  s->current      = s->top;
+  s->saved_row    = 0;
+  s->saved_column = 0;
+  s->height       = height_opt;
+  s->history      = 1;
+
+  s->tabs         = NULL;
+  s->tabs_len     = 0;
+  s->tabs_default = 1;
+  screen_tabs_reserve(s, width);
+}
+
+/* ================================================================ */
+/* Move the cursor to the next line, scrolling the screen up if the */
+/* cursor was on its last line. The line scrolled out is kept when  */
+/* the screen has an history, otherwise it is recycled and becomes  */
+/* the new blank bottom line.                                       */
+/* ================================================================ */
+void
+screen_line_feed(screen_t * s)
+{
+  ll_node_t * node;
+
+  /* The top row is about to leave the main screen, its line is final */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (index_file != NULL && s == &main_screen
+      && (s->current == s->lines->tail || s->current == s->bottom))
+    index_line((line_t *)s->top->data);
+
+  if (s->current == s->lines->tail)
+  {
+    if (s->history
+        && (max_history == 0 || s->lines->len < s->height + max_history))
+    {
+      ll_append(s->lines, &blank_line);
+      s->top = s->top->next;
+
+#ifndef NO_STATS
+      if (s->lines->len - s->height > stats.peak_history)
+        stats.peak_history = s->lines->len - s->height;
+#endif
+    }
+    else
+    {
+      /* The oldest line, the top one without history, is recycled */
+      /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+      node = s->lines->head;
+      if (node != s->bottom)
+      {
+        s->top = s->top->next;
+        ll_move_after(s->lines, node, node, s->bottom);
+      }
+      row_clear(node);
+    }
+    s->current = s->lines->tail;
+    s->bottom  = s->current;
+  }
+  else
+  {
+    if (s->current == s->bottom)
+    {
+      s->top    = s->top->next;
+      s->bottom = s->bottom->next;
+    }
+    s->current = s->current->next;
+  }
+}
+
+/* ================================================ */
+/* Save the cursor position as the row number from  */
+/* the top of the screen and the column (DECSC).    */
+/* ================================================ */
+void
+screen_save_cursor(screen_t * s)
+{
+  ll_node_t * node;
+
+  s->saved_row = 0;
+  node         = s->current;
+  while (node != s->top)
+  {
+    s->saved_row++;
+    node = node->prev;
+  }
+  s->saved_column = s->column;
+}
+
+/* ================================================================ */
+/* Bring the cursor back to the last column if it is after it. This */
+/* happens when the number of columns is limited and a character    */
+/* has just been written in the last column (autowrap pending).     */
+/* ================================================================ */
+void
+screen_clamp_column(screen_t * s)
+{
+  if (width && s->column >= width)
+    s->column = width - 1;
+  else if (!width && max_columns && s->column >= max_columns)
+    s->column = max_columns - 1;
+}
+
+/* ================================================================ */
+/* Make sure that the tab stops bitset covers at least columns      */
+/* columns, the new columns get the default stops (every 8 columns) */
+/* unless all the stops have been cleared.                          */
+/* ================================================================ */
+void
+screen_tabs_reserve(screen_t * s, unsigned columns)
+{
+  unsigned c, words, old_words;
+
+  if (columns <= s->tabs_len)
+    return;
+
+  old_words = (s->tabs_len + TAB_BITS - 1) / TAB_BITS;
+  words     = (columns + TAB_BITS - 1) / TAB_BITS;
+  if (words > old_words)
+  {
+    s->tabs = xrealloc(s->tabs, sizeof(unsigned long) * words);
+    memset(s->tabs + old_words, 0, sizeof(unsigned long) * (words - old_words));
+  }
+
+  if (s->tabs_default)
+    for (c = (s->tabs_len + 7) / 8 * 8; c < columns; c += 8)
+      if (c > 0)
+        s->tabs[c / TAB_BITS] |= 1UL << (c % TAB_BITS);
+
+  s->tabs_len = columns;
+}
+
+/* ================================================================= */
+/* Returns the column of the first tab stop after column, a whole    */
+/* word of the bitset is examined at once. The cursor goes to the    */
+/* last column if there is none, or stays there when the number of   */
+/* columns is not limited.                                           */
+/* ================================================================= */
+unsigned
+screen_tab_next(screen_t * s, unsigned column)
+{
+  unsigned      c = column + 1;
+  unsigned      i, words;
+  unsigned long word;
+
+  if (c < s->tabs_len)
+  {
+    words = (s->tabs_len + TAB_BITS - 1) / TAB_BITS;
+    i     = c / TAB_BITS;
+    word  = s->tabs[i] & (~0UL << (c % TAB_BITS));
+    for (;;)
+    {
+      if (word)
+      {
+        c = i * TAB_BITS + CTZL(word);
+        goto found;
+      }
+      if (++i == words)
+        break;
+      word = s->tabs[i];
+    }
+  }
+
+  /* Not in the bitset, the columns after it have the default stops */
+  /* unless all the stops have been cleared.                        */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (s->tabs_default)
+    c = ((c > s->tabs_len ? c : s->tabs_len) + 7) / 8 * 8;
+  else
+    c = width ? width - 1 : column;
+
+found:
+  if (width && c >= width)
+    c = width - 1;
+
+  return c;
+}
+
+/* ================================================================ */
+/* Returns the column of the last tab stop before column, or 0 if   */
+/* there is none.                                                   */
+/* ================================================================ */
+unsigned
+screen_tab_prev(screen_t * s, unsigned column)
+{
+  unsigned      c;
+  unsigned      i;
+  unsigned long word;
+
+  if (column == 0)
+    return 0;
+
+  c = column - 1;
+  if (c >= s->tabs_len)
+  {
+    if (s->tabs_default && c / 8 * 8 >= s->tabs_len)
+      return c / 8 * 8;
+
+    if (s->tabs_len == 0)
+      return 0;
+    c = s->tabs_len - 1;
+  }
+
+  i    = c / TAB_BITS;
+  word = s->tabs[i] & (~0UL >> (TAB_BITS - 1 - c % TAB_BITS));
+  for (;;)
+  {
+    if (word)
+      return i * TAB_BITS + TAB_BITS - 1 - CLZL(word);
+    if (i == 0)
+      return 0;
+    word = s->tabs[--i];
+  }
+}
+
+/* ================================================================= */
+/* Called before writing a character, if the previous one filled the */
+/* last column, go to the beginning of the next line in autowrap     */
+/* mode (DECAWM) or overwrite the last column otherwise.             */
+/* ================================================================= */
+void
+screen_wrap(screen_t * s)
+{
+  if (!width || s->column < width)
+    return;
+
+  if (autowrap)
+  {
+    line_touch(s->current)->wrapped = 1;
+    screen_line_feed(s);
+    s->column = 0;
+  }
+  else
+    s->column = width - 1;
+}
+
+/* ================================================================= */
+/* Write n copies of a character using w cells at the cursor position */
+/* and move the cursor after them, wrapping at the right margin.      */
+/* A wide character never straddles two lines, when it does not fit   */
+/* in the last column, this column is left blank.                     */
+/* ================================================================= */
+void
+screen_put(screen_t * s, cell_t * cells, unsigned w, unsigned n)
+{
+  static cell_t blank = { ' ', NULL };
+
+  unsigned chunk;
+  line_t * line;
+
+  if (width && w > width)
+    return;
+
+  while (n > 0)
+  {
+    /* Beyond the maximum number of columns, the lines are truncated */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (!width && max_columns && s->column + w > max_columns)
+      return;
+
+    if (!width && max_columns && n > (max_columns - s->column) / w)
+      n = (max_columns - s->column) / w;
+
+    screen_wrap(s);
+    line = line_touch(s->current);
+
+    if (width && w > width - s->column)
+    {
+      if (!autowrap)
+        s->column = width - w;
+      else
+      {
+        line_write(line, s->column, &blank, 1, 1);
+        s->column = width;
+        continue;
+      }
+    }
+
+    /* The copies are written by chunks ending at the right margin */
+    /* when the number of columns is limited.                      */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    chunk = n;
+    if (width && chunk > (width - s->column) / w)
+      chunk = (width - s->column) / w;
+
+    line_write(line, s->column, cells, w, chunk);
+    s->column += w * chunk;
+    n -= chunk;
+
+    if (width && s->column == width && !autowrap)
+    {
+      s->column = width - 1;
+      break;
+    }
+  }
+}
+
+/* ======================================================= */
+/* Restore the cursor position saved by screen_save_cursor */
+/* ======================================================= */
+void
+screen_restore_cursor(screen_t * s)
+{
+  unsigned n = s->saved_row;
+
+  s->current = s->top;
+  while (n > 0 && s->current != s->bottom)
+  {
+    s->current = s->current->next;
+    n--;
+  }
+  s->column = s->saved_column;
+}
+
+/* ================================================================= */
+/* Switch to the alternate screen (alt=1) or back to the main screen */
+/* (alt=0), this only changes the active screen pointer.             */
+/*                                                                   */
+/* mode (IN): the DEC private mode requesting the switch:            */
+/*            47:   switch only                                      */
+/*            1047: the alternate screen is cleared when left        */
+/*            1049: the cursor is saved and the alternate screen is  */
+/*                  cleared when entered, the cursor is restored     */
+/*                  when it is left.                                 */
+/* ================================================================= */
+void
+screen_switch(unsigned alt, unsigned mode)
+{
+  ll_node_t * node;
+
+  if (alt == (screen == &alt_screen))
+    return;
+
+  if (alt)
+  {
+    if (alt_screen.lines == NULL)
+    {
+      screen_init(&alt_screen, main_screen.height);
+      alt_screen.history = 0;
+    }
+
+    if (mode == 1049)
+    {
+      screen_save_cursor(&main_screen);
+
+      for (node = alt_screen.top; node != alt_screen.bottom->next;
+           node = node->next)
+        row_clear(node);
+
+      /* The cursor stays where it was on the main screen */
+      /* """""""""""""""""""""""""""""""""""""""""""""""" */
+      alt_screen.saved_row    = main_screen.saved_row;
+      alt_screen.saved_column = main_screen.saved_column;
+      screen_restore_cursor(&alt_screen);
+    }
+
+    screen = &alt_screen;
+  }
+  else
+  {
+    if (mode == 1047)
+      for (node = alt_screen.top; node != alt_screen.bottom->next;
+           node = node->next)
+        row_clear(node);
+
+    screen = &main_screen;
+
+    if (mode == 1049)
+      screen_restore_cursor(&main_screen);
+  }
+}
+
+/* ================================================================= */
+/* Returns the number of cells of a logical line of len cells taken  */
+/* by the row starting at from when it is cut at the current width.  */
+/* A wide character cannot straddle two rows, the row is then one    */
+/* cell shorter and gets a blank in its last column.                 */
+/* ================================================================= */
+unsigned
+reflow_row_cells(cell_t * buf, unsigned from, unsigned len)
+{
+  unsigned n = len - from < width ? len - from : width;
+
+  if (n == width && width > 1 && from + n < len
+      && buf[from + n].cp == WIDE_CONT)
+    n--;
+
+  return n;
+}
+
+/* ================================================================== */
+/* Re-wrap the lines of a screen after a change of the number of      */
+/* columns. The logical lines made of soft wrapped lines are rebuilt  */
+/* and cut again at the new width in a single pass over the lines,    */
+/* the existing lines are reused and the cursor follows the character */
+/* it was on. The top of the screen is moved to the line holding the  */
+/* first character of the previous top line.                          */
+/* The history is trimmed to max_history lines on the way and no row  */
+/* is added once the heap limit would be exceeded, the logical lines  */
+/* are then truncated to the rows they already have.                  */
+/*                                                                    */
+/* old_width (IN): number of columns before the change.               */
+/* ================================================================== */
+void
+screen_reflow(screen_t * s, unsigned old_width)
+{
+  static cell_t * buf;
+  static unsigned allocated;
+
+  ll_node_t * node;
+  ll_node_t * first;
+  ll_node_t * next;
+  ll_node_t * current = NULL;
+  ll_node_t * top     = NULL;
+  line_t *    line;
+  unsigned    len, rows, r, n, from;
+  unsigned    cursor_p, cursor_row = 0, cursor_col = 0;
+  unsigned    top_p, top_row = 0;
+  unsigned    cursor_v, top_v, end_v;
+  unsigned    above = 0; /* rows above the logical line, before the top */
+  size_t      row_size;
+  int         cursor_here, top_here;
+
+  row_size = ARENA_ROUND(sizeof(line_t)) + ARENA_ROUND(sizeof(ll_node_t))
+             + sizeof(cell_t) * (CELLS_MIN << cells_class(width));
+
+  node = s->lines->head;
+  while (node)
+  {
+    /* The rows above the future top are history */
+    /* """"""""""""""""""""""""""""""""""""""""" */
+    if (top == NULL && s->history && max_history)
+      for (; above > max_history; above--)
+      {
+        first = s->lines->head;
+        ll_delete(s->lines, first);
+        line_release((line_t *)first->data);
+        ll_free_node(first);
+      }
+
+    /* Gather the logical line starting at node, the soft wrapped */
+    /* lines are padded with blanks up to the old width.          */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    first       = node;
+    len         = 0;
+    cursor_p    = 0;
+    cursor_here = 0;
+    top_p       = 0;
+    top_here    = 0;
+    for (;;)
+    {
+      line = (line_t *)node->data;
+
+      if (node == s->top)
+      {
+        top_here = 1;
+        top_p    = len;
+      }
+
+      if (allocated < len + old_width)
+      {
+        allocated = len + old_width + 1024;
+        buf       = xrealloc(buf, sizeof(cell_t) * allocated);
+      }
+
+      if (node == s->current)
+      {
+        cursor_here = 1;
+        cursor_p    = len + s->column;
+      }
+
+      if (line->length > 0)
+      {
+        memcpy(buf + len, line->cells, sizeof(cell_t) * line->length);
+        STAT_ADD(cell_moves, 1);
+        STAT_ADD(cells_moved, line->length);
+      }
+      if (line->wrapped && line->length < old_width)
+      {
+        for (n = line->length; n < old_width; n++)
+        {
+          buf[len + n].cp    = ' ';
+          buf[len + n].attrs = NULL;
+        }
+        len += old_width;
+      }
+      else
+        len += line->length;
+
+      if (!line->wrapped || node->next == NULL)
+        break;
+      node = node->next;
+    }
+    next = node->next;
+
+    /* Find the rows of the cut logical line, the positions of the   */
+    /* cursor and of the top are converted to positions in the rows, */
+    /* where all the rows but the last one have width cells. The     */
+    /* positions past the end are kept past the end of the last row. */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    rows     = 0;
+    from     = 0;
+    cursor_v = top_v = UINT_MAX;
+    do
+    {
+      n = reflow_row_cells(buf, from, len);
+      if (cursor_p >= from && cursor_p < from + n)
+        cursor_v = rows * width + cursor_p - from;
+      if (top_p >= from && top_p < from + n)
+        top_v = rows * width + top_p - from;
+      from += n;
+      rows++;
+    } while (from < len);
+
+    end_v = (rows - 1) * width + n;
+    if (cursor_v == UINT_MAX)
+      cursor_v = end_v + cursor_p - len;
+    if (top_v == UINT_MAX)
+      top_v = end_v + top_p - len;
+
+    if (cursor_here)
+    {
+      if (cursor_v > 0 && cursor_v == end_v && cursor_v % width == 0)
+      {
+        /* The cursor was waiting for an autowrap */
+        /* """""""""""""""""""""""""""""""""""""" */
+        cursor_row = cursor_v / width - 1;
+        cursor_col = width;
+      }
+      else
+      {
+        cursor_row = cursor_v / width;
+        cursor_col = cursor_v % width;
+      }
+
+      if (cursor_row >= rows)
+      {
+        cursor_row = rows - 1;
+        cursor_col = width - 1;
+      }
+    }
+
+    if (top_here)
+      top_row = top_v / width < rows ? top_v / width : rows - 1;
+
+    /* Cut the logical line at the new width */
+    /* """"""""""""""""""""""""""""""""""""" */
+    node = first;
+    from = 0;
+    for (r = 0; r < rows; r++)
+    {
+      if (r > 0)
+      {
+        if (node->next == next)
+        {
+          if (stopped || (max_heap && heap_used + row_size > max_heap))
+          {
+            limit_reached("heap");
+            break;
+          }
+          ll_insert_after(s->lines, node, line_new());
+        }
+        node = node->next;
+      }
+
+      n = reflow_row_cells(buf, from, len);
+
+      /* Only an empty logical line gives an empty row */
+      /* """"""""""""""""""""""""""""""""""""""""""""" */
+      if (n == 0)
+        row_clear(node);
+      else
+      {
+        line = line_touch(node);
+        line_reserve(line, n < width ? n + 1 : n);
+        memcpy(line->cells, buf + from, sizeof(cell_t) * n);
+        line->length  = n;
+        line->wrapped = (r < rows - 1);
+
+        /* Blank in place of a wide character moved to the next row */
+        /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+        if (line->wrapped && n < width)
+        {
+          line->cells[n].cp    = ' ';
+          line->cells[n].attrs = NULL;
+          line->length++;
+        }
+      }
+      from += n;
+
+      if (cursor_here && r == cursor_row)
+        current = node;
+      if (top_here && r == top_row)
+        top = node;
+    }
+
+    /* The logical line has been truncated to r rows */
+    /* """"""""""""""""""""""""""""""""""""""""""""" */
+    if (r < rows)
+    {
+      ((line_t *)node->data)->wrapped = 0;
+
+      if (cursor_here && cursor_row >= r)
+      {
+        current    = node;
+        cursor_col = width - 1;
+      }
+      if (top_here && top_row >= r)
+        for (top = node, n = 1; n < s->height && top != first; n++)
+          top = top->prev;
+    }
+    above += r;
+
+    /* Free the lines no more needed by this logical line */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""" */
+    while (node->next != next)
+    {
+      ll_node_t * unused = node->next;
+
+      ll_delete(s->lines, unused);
+      line_release((line_t *)unused->data);
+      ll_free_node(unused);
+    }
+
+    node = next;
+  }
+
+  s->top     = top;
+  s->current = current;
+  s->column  = cursor_col;
+}
+
+/* ================================================================== */
+/* Give a new height to a screen whose lines have possibly been       */
+/* re-wrapped. The top of the screen stays where it is unless the     */
+/* cursor would not be visible anymore, in which case the screen is   */
+/* scrolled up to have the cursor on its last line.                   */
+/* The blank lines pushed after the bottom of the screen are dropped, */
+/* screens without history only keep their visible lines.             */
+/* ================================================================== */
+void
+screen_set_height(screen_t * s, unsigned height)
+{
+  ll_node_t * node;
+  unsigned    rows, i;
+
+  rows = 0;
+  for (node = s->top; node != s->current; node = node->next)
+    rows++;
+
+  for (; rows >= height; rows--)
+  {
+    if (index_file != NULL && s == &main_screen)
+      index_line((line_t *)s->top->data);
+    s->top = s->top->next;
+  }
+
+  s->height = height;
+  s->bottom = s->top;
+  for (i = 1; i < height; i++)
+  {
+    if (s->bottom->next == NULL)
+      ll_append(s->lines, &blank_line);
+    s->bottom = s->bottom->next;
+  }
+
+  while (s->lines->tail != s->bottom
+         && (!s->history || ((line_t *)s->lines->tail->data)->length == 0))
+  {
+    node = s->lines->tail;
+    ll_delete(s->lines, node);
+    line_release((line_t *)node->data);
+    ll_free_node(node);
+  }
+
+  if (!s->history)
+    while (s->lines->head != s->top)
+    {
+      node = s->lines->head;
+      ll_delete(s->lines, node);
+      line_release((line_t *)node->data);
+      ll_free_node(node);
+    }
+}
+
+/* ================================================================== */
+/* Resize the virtual screen, used when a resize sequence is read.    */
+/* A 0 dimension is left unchanged, an unlimited number of columns    */
+/* (no -c option) stays unlimited. Only the soft wrapped lines are    */
+/* re-wrapped so the cost is proportional to the size of the history. */
+/* ================================================================== */
+void
+resize(unsigned height, unsigned columns)
+{
+  unsigned    old_width = width;
+  screen_t *  screens[2];
+  unsigned    i;
+
+  screens[0] = &main_screen;
+  screens[1] = &alt_screen;
+
+  if (height == 0)
+    height = main_screen.height;
+  if (columns == 0 || width == 0)
+    columns = width;
+
+  if (max_rows && height > max_rows)
+    height = max_rows;
+  if (max_columns && columns > max_columns)
+    columns = max_columns;
+
+  width = columns;
+
+  for (i = 0; i < 2; i++)
+  {
+    if (screens[i]->lines == NULL)
+      continue;
+
+    /* The top and bottom of the screen are always recomputed after */
+    /* a re-wrap as their lines may have been freed.                */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (width != old_width)
+      screen_reflow(screens[i], old_width);
+    if (width != old_width || height != screens[i]->height)
+      screen_set_height(screens[i], height);
+
+    screen_tabs_reserve(screens[i], width);
+  }
+}
+
+/* ===================================================== */
+/* Callback function called for each DEC decoded element */
+/* ===================================================== */
+void
+parser_callback(vtparse_t * parser, vtparse_action_t action, unsigned char ch)
+{
+  line_t *        cl;
+  ll_node_t *     node;
+  unsigned        i;
+  cell_t *        prev;
+  unsigned *      cps;
+
+  if (stopped)
+    return;
+
+  STAT_ADD(actions[action & 15], 1);
+
+  if (trace_file != NULL)
+    trace_action(parser, action, ch);
+
+  switch (action)
+  {
+    case VTPARSE_ACTION_PRINT:
+      /* TODO: manage 0x7f (DEL) */
+      /* """"""""""""""""""""""" */
+
+      /* Rebuild the character from its UTF-8 bytes, the parser has */
+      /* already checked the validity of the sequence.              */
+      /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+      if (ch <= 0x7f)
+      {
+        if (translation == NULL)
+          utf8_cp = ch;
+        else
+        {
+          utf8_cp = translation[ch];
+          if (single_shift)
+            charset_update();
+        }
+        utf8_rem = 0;
+      }
+      else if (ch >= 0xc2 && ch <= 0xdf)
+      {
+        utf8_cp  = ch & 0x1f;
+        utf8_rem = 1;
+      }
+      else if (ch >= 0xe0 && ch <= 0xef)
+      {
+        utf8_cp  = ch & 0x0f;
+        utf8_rem = 2;
+      }
+      else if (ch >= 0xf0 && ch <= 0xf4)
+      {
+        utf8_cp  = ch & 0x07;
+        utf8_rem = 3;
+      }
+      else if (utf8_rem > 0)
+      {
+        utf8_cp = (utf8_cp << 6) | (ch & 0x3f);
+        utf8_rem--;
+      }
+
+      if (utf8_rem > 0) /* The UTF-8 sequence is not complete yet */
+        break;
+
+      /* A zero width character, or any character following a zero */
+      /* width joiner, is added to the character before the cursor, */
+      /* it is dropped if there is none.                            */
+      /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+      prev = line_cell_before((line_t *)screen->current->data, screen->column);
+      if (prev != NULL)
+        cps = cluster_get(&prev->cp, &i);
+
+      if (CP_WIDTH(utf8_cp) == 0
+          || (prev != NULL && cps[i - 1] == 0x200d))
+      {
+        if (prev != NULL)
+        {
+          /* The cell must be looked up again in case the line was */
+          /* shared and had to be copied                           */
+          /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
+          prev = line_cell_before(line_touch(screen->current),
+                                  screen->column);
+          cell_attach(prev, utf8_cp);
+        }
+        break;
+      }
+
+      glyph_width    = CP_WIDTH(utf8_cp);
+      glyph[0].cp    = utf8_cp;
+      glyph[0].attrs = glyph[1].attrs = curr_attrs;
+
+      screen_put(screen, glyph, glyph_width, 1);
+      break;
+
+    case VTPARSE_ACTION_ESC_DISPATCH:
+      STAT_ADD(esc[ch & 0x7f], 1);
+      if (parser->num_intermediate_chars == 1)
+      {
+        unsigned g;
+
+        /* Designate a character set as G0 to G3 */
+        /* """"""""""""""""""""""""""""""""""""" */
+        switch (parser->intermediate_chars[0])
+        {
+          case '(':
+          case ')':
+          case '*':
+          case '+':
+            g = parser->intermediate_chars[0] - '(';
+            switch (ch)
+            {
+              case 'A': /* United Kingdom */
+                charsets[g] = CHARSET_UK;
+                break;
+
+              case 'B': /* United States */
+              case '1': /* Alternate character ROM */
+                charsets[g] = CHARSET_US;
+                break;
+
+              case '0': /* Special characters and line set */
+              case '2': /* Alternate character ROM special graphics */
+                charsets[g] = CHARSET_DEC_GRAPHICS;
+                break;
+            }
+            charset_update();
+            break;
+        }
+        break;
+      }
+
+      if (parser->num_intermediate_chars > 0)
+        break;
+
+      switch (ch)
+      {
+        case 'H': /* Set a tab stop at the current column HTS */
+          screen_clamp_column(screen);
+          screen_tabs_reserve(screen, screen->column + 1);
+          screen->tabs[screen->column / TAB_BITS] |=
+            1UL << (screen->column % TAB_BITS);
+          break;
+
+        case 'N': /* Single shift 2 SS2 */
+        case 'O': /* Single shift 3 SS3 */
+          single_shift = 1;
+          translation  = charset_tables[charsets[ch == 'N' ? 2 : 3]];
+          break;
+
+        case '7': /* Save cursor position and attributes DECSC */
+          screen_save_cursor(screen);
+          break;
+
+        case '8': /* Restore cursor position and attributes DECSC */
+          screen_restore_cursor(screen);
+          break;
+
+        case 'E':
+          screen_line_feed(screen);
+          screen->column = 0;
+          break;
+
+        case 'D':
+          if (screen->current != screen->bottom)
+            screen->current = screen->current->next;
+          /* TODO: scroll up when the bottom of region is reached */
+          break;
+
+        case 'M':
+          if (screen->current != screen->top)
+            screen->current = screen->current->prev;
+          /* TODO: scroll down when the top of region is reached */
+          break;
+
+        default:
+          break;
+      }
+      break;
+
+    case VTPARSE_ACTION_CSI_DISPATCH:
+      STAT_ADD(csi[ch & 0x7f], 1);
+      switch (ch)
+      {
+        case 'A': /* Move cursor up n lines CUU */
+          if (parser->num_params == 0)
+          {
+            if (screen->current != screen->top)
+              screen->current = screen->current->prev;
+          }
+          else
+            for (i = 0; i < parser->params[0]; i++)
+            {
+              if (screen->current != screen->top)
+                screen->current = screen->current->prev;
+              else
+                break;
+            }
+          break;
+
+        case 'B': /* Move cursor down n lines CUD */
+          if (parser->num_params == 0)
+          {
+            if (screen->current != screen->bottom)
+              screen->current = screen->current->next;
+          }
+          else
+            for (i = 0; i < parser->params[0]; i++)
+            {
+              if (screen->current != screen->bottom)
+                screen->current = screen->current->next;
+              else
+                break;
+            }
+          break;
+
+        case 'C': /* Move cursor right n lines CUF */
+          screen->column += CSI_COUNT(parser);
+          screen_clamp_column(screen);
+          break;
+
+        case 'D': /* Move cursor left n lines CUB */
+        {
+          unsigned n = CSI_COUNT(parser);
+
+          screen_clamp_column(screen);
+          if (n > screen->column)
+            screen->column = 0;
+          else
+            screen->column -= n;
+          break;
+        }
+
+        case 'I': /* Move to the nth next tab stop CHT */
+        case 'Z': /* Move to the nth previous tab stop CBT */
+        {
+          unsigned n = CSI_COUNT(parser);
+          unsigned column;
+
+          screen_clamp_column(screen);
+          while (n-- > 0)
+          {
+            if (ch == 'I')
+              column = screen_tab_next(screen, screen->column);
+            else
+              column = screen_tab_prev(screen, screen->column);
+
+            if (column == screen->column)
+              break;
+            screen->column = column;
+          }
+          break;
+        }
+
+        case 'g': /* Clear tab stops TBC */
+          if (parser->num_params == 0 || parser->params[0] == 0)
+          {
+            /* At the current column */
+            /* """"""""""""""""""""" */
+            screen_clamp_column(screen);
+            screen_tabs_reserve(screen, screen->column + 1);
+            screen->tabs[screen->column / TAB_BITS] &=
+              ~(1UL << (screen->column % TAB_BITS));
+          }
+          else if (parser->params[0] == 3)
+          {
+            /* All of them */
+            /* """"""""""" */
+            if (screen->tabs != NULL)
+              memset(screen->tabs, 0, sizeof(unsigned long)
+                                        * ((screen->tabs_len + TAB_BITS - 1)
+                                           / TAB_BITS));
+            screen->tabs_default = 0;
+          }
+          break;
+
+        case 'G': /* Move cursor - hpa */
+          if (parser->num_params == 0 || parser->params[0] == 0)
+            screen->column = 0;
+          else
+            screen->column = parser->params[0] - 1;
+          screen_clamp_column(screen);
+          break;
+
+        case 'f': /* Move cursor */
+        case 'H': /* Move cursor */
+          if (parser->num_params == 0)
+          {
+            /* To upper left corner - cursorhome */
+            screen->current = screen->top;
+            screen->column  = 0;
+          }
+          else /* Move cursor to screen location y,x - CUP */
+          {
+            unsigned x, y;
+
+            /* A missing column means the first one */
+            /* """""""""""""""""""""""""""""""""""" */
+            y = parser->params[0];
+            x = parser->num_params > 1 ? parser->params[1] : 0;
+
+            /* x and y are 1 based byt treats 0 the same as 1 */
+            /* """""""""""""""""""""""""""""""""""""""""""""" */
+            if (x > 0)
+              x--;
+            if (y > 0)
+              y--;
+
+            if (y >= screen->height)
+              y = screen->height - 1;
+
+            /* go down y lines from th first line */
+            /* """""""""""""""""""""""""""""""""" */
+            node = screen->top;
+            for (i = 0; i < y; i++)
+              node = node->next;
+
+            screen->current = node;
+            screen->column  = x;
+            screen_clamp_column(screen);
+          }
+          break;
+
+        case 'J':
+        {
+          ll_node_t * start_node = screen->top;
+          ll_node_t * stop_node  = screen->bottom;
+
+          if (parser->num_params == 0
+              || (parser->num_params == 1 && parser->params[0] == 0))
+          {
+            start_node = screen->current;
+            stop_node  = screen->bottom;
+          }
+          else if (parser->num_params == 1)
+          {
+            switch (parser->params[0])
+            {
+              case 1:
+                start_node = screen->top;
+                stop_node  = screen->current;
+                break;
+
+              case 2:
+                start_node = screen->top;
+                stop_node  = screen->bottom;
+                break;
+            }
+          }
+
+          node = start_node;
+          do
+          {
+            row_clear(node);
+            node = node->next;
+          } while (node != NULL && node != stop_node);
+        }
+        break;
+
+        case 'K': /* Clear line */
+        {
+          unsigned end;
+
+          /* Nothing is erased from an empty line */
+          /* """""""""""""""""""""""""""""""""""" */
+          cl = (line_t *)screen->current->data;
+          if (cl->length == 0)
+            break;
+
+          cl = line_touch(screen->current);
+          if (parser->num_params == 0
+              || (parser->num_params == 1 && parser->params[0] == 0))
+          {
+            if (screen->column < cl->length)
+            {
+              line_split_wide(cl, screen->column);
+              cl->length = screen->column;
+            }
+          }
+          else
+            switch (parser->params[0])
+            {
+              case 1:
+                /* from cursor left EL1 */
+                end = screen->column < cl->length ? screen->column : cl->length;
+                line_split_wide(cl, end);
+                line_blank(cl, 0, end);
+                break;
+              case 2:
+                /* from entire line EL2 */
+                row_clear(screen->current);
+                break;
+            }
+          break;
+        }
+
+        case '@': /* Insert n blank characters ICH */
+          cl = (line_t *)screen->current->data;
+          if (screen->column < cl->length)
+          {
+            cl = line_touch(screen->current);
+            line_insert(cl, screen->column, CSI_COUNT(parser));
+          }
+          break;
+
+        case 'P': /* Delete n characters DCH */
+          cl = (line_t *)screen->current->data;
+          if (screen->column < cl->length)
+          {
+            cl = line_touch(screen->current);
+            line_delete(cl, screen->column, CSI_COUNT(parser));
+          }
+          break;
+
+        case 'X': /* Erase n characters ECH */
+        {
+          unsigned n = CSI_COUNT(parser);
+
+          cl = (line_t *)screen->current->data;
+          if (screen->column >= cl->length)
+            break;
+
+          cl = line_touch(screen->current);
+          line_split_wide(cl, screen->column);
+
+          /* Trailing blanks are implicit, as with EL0 */
+          /* """"""""""""""""""""""""""""""""""""""""" */
+          if (n >= cl->length - screen->column)
+            cl->length = screen->column;
+          else
+          {
+            line_split_wide(cl, screen->column + n);
+            line_blank(cl, screen->column, screen->column + n);
+          }
+          break;
+        }
+
+        case 'b': /* Repeat the preceding graphic character n times REP */
+          screen_put(screen, glyph, glyph_width, CSI_COUNT(parser));
+          break;
+
+        case 'L': /* Insert n blank lines IL */
+        case 'M': /* Delete n lines DL */
+        {
+          ll_node_t * first;
+          ll_node_t * last;
+          unsigned    n    = CSI_COUNT(parser);
+          unsigned    rows = 1; /* rows from the current one to the bottom */
+
+          for (node = screen->current; node != screen->bottom; node = node->next)
+            rows++;
+
+          screen->column = 0;
+
+          /* All the lines from the cursor are affected, just clear them */
+          /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+          if (n >= rows)
+          {
+            node = screen->current;
+            do
+            {
+              row_clear(node);
+              node = node->next;
+            } while (node != screen->bottom->next);
+            break;
+          }
+
+          /* Otherwise recycle the n lines leaving the screen as the new */
+          /* blank ones, the other lines are moved all at once.          */
+          /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+          if (ch == 'L')
+          {
+            last  = screen->bottom;
+            first = last;
+            for (i = 1; i < n; i++)
+              first = first->prev;
+
+            screen->bottom = first->prev;
+            ll_move_before(screen->lines, first, last, screen->current);
+
+            if (screen->current == screen->top)
+              screen->top = first;
+            screen->current = first;
+          }
+          else
+          {
+            first = screen->current;
+            last  = first;
+            for (i = 1; i < n; i++)
+              last = last->next;
+
+            screen->current = last->next;
+            if (first == screen->top)
+              screen->top = screen->current;
+            ll_move_after(screen->lines, first, last, screen->bottom);
+
+            screen->bottom = last;
+          }
+
+          for (node = first; node != last->next; node = node->next)
+            row_clear(node);
+          break;
+        }
+
+        case 'n': /* Device status report DSR, only answered to a command */
+          if (pty_fd < 0 || parser->num_intermediate_chars != 0
+              || parser->num_params != 1)
+            break;
+
+          if (parser->params[0] == 5) /* Status: OK */
+            pty_answer("\033[0n");
+          else if (parser->params[0] == 6) /* Cursor position CPR */
+          {
+            ll_node_t * node = screen->top;
+            unsigned    row  = 1;
+            char        answer[32];
+
+            while (node != screen->current && node != screen->bottom)
+            {
+              node = node->next;
+              row++;
+            }
+
+            sprintf(answer, "\033[%u;%uR", row,
+                    width && screen->column >= width ? width
+                                                     : screen->column + 1);
+            pty_answer(answer);
+          }
+          break;
+
+        case 'c': /* Primary device attributes DA: VT100 with AVO */
+          if (pty_fd >= 0 && parser->num_intermediate_chars == 0
+              && (parser->num_params == 0 || parser->params[0] == 0))
+            pty_answer("\033[?1;2c");
+          break;
+
+        case 't': /* Window manipulation, only the resize is managed */
+          if (parser->num_params == 3 && parser->params[0] == 8)
+            resize(parser->params[1], parser->params[2]);
+          break;
+
+        case 'h': /* Set DEC private mode DECSET */
+        case 'l': /* Reset DEC private mode DECRST */
+          if (parser->num_intermediate_chars != 1
+              || parser->intermediate_chars[0] != '?')
+            break;
+
+          for (i = 0; i < parser->num_params; i++)
+            switch (parser->params[i])
+            {
+              case 47:   /* Alternate screen */
+              case 1047: /* Alternate screen, cleared when left */
+              case 1049: /* Alternate screen with cursor save/restore */
+                screen_switch(ch == 'h', parser->params[i]);
+                break;
+
+              case 7: /* Auto-wrap mode DECAWM */
+                autowrap = (ch == 'h');
+                break;
+            }
+          break;
+
+        case 'm':
+          if (!no_attr)
+          {
+            if (parser->num_params == 0
+                || (parser->num_params == 1 && parser->params[0] == '\0'))
+              curr_attrs = NULL;
+            else
+            {
+              /* The cells share the attribute structures, the new    */
+              /* attributes are built here then interned.             */
+              /* """""""""""""""""""""""""""""""""""""""""""""""""""" */
+              attrs_bytes_t   attrs[1];
+              unsigned char   bytes[256 + MAX_PARAMS];
+              unsigned char   params[MAX_PARAMS];
+              unsigned        n = 0;
+              unsigned        p, next, color;
+              unsigned        fg, bg;
+
+              fg = curr_attrs ? curr_attrs->fg : 0;
+              bg = curr_attrs ? curr_attrs->bg : 0;
+
+              /* Attributes are stored as bytes, except the extended  */
+              /* colors which consume their own parameters. The       */
+              /* sub-parameters of the other attributes are ignored.  */
+              /* """""""""""""""""""""""""""""""""""""""""""""""""""" */
+              for (i = 0; i < parser->num_params; i = next)
+              {
+                p    = parser->params[i];
+                next = i + 1;
+
+                if (p == 38 || p == 48)
+                {
+                  next = sgr_color(parser, i, &color);
+                  if (p == 38)
+                    fg = color;
+                  else
+                    bg = color;
+                  continue;
+                }
+
+                while (next < parser->num_params
+                       && (parser->subparams & (1u << next)))
+                  next++;
+
+                if (p == 39 || (p >= 30 && p <= 37) || (p >= 90 && p <= 97))
+                  fg = 0;
+                else if (p == 49 || (p >= 40 && p <= 47)
+                         || (p >= 100 && p <= 107))
+                  bg = 0;
+
+                if (p <= 255)
+                  params[n++] = p;
+              }
+              qsort(params, n, 1, compar);
+
+              attrs->bytes = bytes;
+              attrs->fg    = fg;
+              attrs->bg    = bg;
+
+              /* The current attribute structure is empty */
+              /* """""""""""""""""""""""""""""""""""""""" */
+              if (curr_attrs == NULL)
+              {
+                attrs->len = n;
+                memcpy(attrs->bytes, params, n);
+              }
+              else
+              {
+                /* The current attribute structure already contains */
+                /* some attributes, we need to merge the new ones   */
+                /* """""""""""""""""""""""""""""""""""""""""""""""" */
+                attrs->len = attrs_merge(curr_attrs->bytes, curr_attrs->len,
+                                         params, n, attrs->bytes);
+              }
+
+              attrs_hash(attrs);
+              curr_attrs = attrs_intern(attrs);
+            }
+          }
+          break;
+
+        default:
+          break;
+      }
+      break;
+
+    case VTPARSE_ACTION_EXECUTE:
+      switch (ch)
+      {
+        case 0x0d: /* Carriage return */
+          screen->column = 0;
+          break;
+
+        case 0x08: /* Backspace */
+          screen_clamp_column(screen);
+          if (screen->column > 0)
+            screen->column--;
+          break;
+
+        case 0x09: /* Tab */
+          screen_clamp_column(screen);
+          screen->column = screen_tab_next(screen, screen->column);
+          break;
+
+        case 0x0a: /* Line feed */
+          screen_line_feed(screen);
+          screen->column = 0;
+          break;
+
+        case 0x0e: /* Shift out SO, invoke G1 */
+        case 0x0f: /* Shift in SI, invoke G0 */
+          gl = (ch == 0x0e);
+          charset_update();
+          break;
+      }
+      break;
+
+    case VTPARSE_ACTION_CLEAR:
+      break;
+
+    case VTPARSE_ACTION_COLLECT:
+      break;
+
+    case VTPARSE_ACTION_HOOK:
+      break;
+
+    case VTPARSE_ACTION_UNHOOK:
+      break;
+
+    case VTPARSE_ACTION_OSC_END:
+      osc_dispatch();
+      break;
+
+    case VTPARSE_ACTION_OSC_PUT:
+      osc_put(parser->string_data, parser->string_data_len);
+      break;
+
+    case VTPARSE_ACTION_OSC_START:
+      osc_len = 0;
+      break;
+
+    case VTPARSE_ACTION_PARAM:
+      break;
+
+    case VTPARSE_ACTION_PUT:
+      break;
+
+    case VTPARSE_ACTION_IGNORE:
+      break;
+
+    case VTPARSE_ACTION_ERROR:
+      /* An invalid UTF-8 sequence is replaced by U+FFFD */
+      /* """"""""""""""""""""""""""""""""""""""""""""""" */
+      utf8_rem       = 0;
+      glyph_width    = 1;
+      glyph[0].cp    = 0xfffd;
+      glyph[0].attrs = curr_attrs;
+      screen_put(screen, glyph, glyph_width, 1);
+      break;
+  }
+}
+
+/* ===================================================== */
+/* Encode a character in UTF-8.                          */
+/* OUT: out receives the bytes (up to 4, not terminated) */
+/* Returns the number of bytes written.                  */
+/* ===================================================== */
+int
+utf8_encode(unsigned cp, char * out)
+{
+  if (cp < 0x80)
+  {
+    out[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800)
+  {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  }
+  if (cp < 0x10000)
+  {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3f);
+  out[2] = 0x80 | ((cp >> 6) & 0x3f);
+  out[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+/* ================================================================= */
+/* Returns the UTF-8 content of a line as a NUL terminated string.   */
+/* The string is stored in a static buffer overwritten at each call. */
+/* ================================================================= */
+char *
+line_string(line_t * line)
+{
+  static char *   string;
+  static unsigned allocated;
+  unsigned        i, j, n, bytes = 0;
+  unsigned *      cps;
+
+  if (allocated == 0)
+  {
+    allocated = 64;
+    string    = xmalloc(allocated);
+  }
+
+  /* The continuation cells of the wide characters are skipped */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  for (i = 0; i < line->length; i++)
+  {
+    if (line->cells[i].cp == WIDE_CONT)
+      continue;
+
+    if (allocated < bytes + CLUSTER_MAX * 4 + 1)
+    {
+      allocated = bytes + CLUSTER_MAX * 4 + 1 + line->length * 4;
+      string    = xrealloc(string, allocated);
+    }
+
+    cps = cluster_get(&line->cells[i].cp, &n);
+    for (j = 0; j < n; j++)
+      bytes += utf8_encode(cps[j], string + bytes);
+  }
+  string[bytes] = '\0';
+
+  return string;
+}
+
+/* ================================================================= */
+/* Take a snapshot of a screen from its top row. The lines are not   */
+/* copied, only referenced, so that the cost is a pointer per row.   */
+/* ================================================================= */
+void
+snapshot_take(screen_t * s, snapshot_t * snap)
+{
+  ll_node_t * node;
+  line_t *    line;
+  unsigned    n = 0;
+
+  for (node = s->top; node != NULL; node = node->next)
+    n++;
+
+  snap->lines      = xmalloc(sizeof(line_t *) * n);
+  snap->rows       = n;
+  snap->height     = s->height < n ? s->height : n;
+  snap->cursor_row = 0;
+
+  n = 0;
+  for (node = s->top; node != NULL; node = node->next)
+  {
+    line = (line_t *)node->data;
+    if (line != &blank_line)
+      line->refs++;
+
+    if (node == s->current)
+      snap->cursor_row = n;
+
+    snap->lines[n++] = line;
+  }
+}
+
+/* =============================================== */
+/* Drop the references held by a snapshot on lines */
+/* =============================================== */
+void
+snapshot_release(snapshot_t * snap)
+{
+  unsigned n;
+
+  for (n = 0; n < snap->rows; n++)
+    line_release(snap->lines[n]);
+
+  free(snap->lines);
+  snap->lines = NULL;
+  snap->rows  = 0;
+}
+
+/* ================================================================ */
+/* Start a digest                                                   */
+/* ================================================================ */
+void
+digest_init(digest_t * d)
+{
+  d->lanes[0] = HASH_SEED1;
+  d->lanes[1] = HASH_SEED2;
+  d->words    = 0;
+}
+
+/* ================================================================ */
+/* Mix a 64 bit word into both lanes of a digest with the round of  */
+/* XXH64.                                                           */
+/* ================================================================ */
+void
+digest_add(digest_t * d, uint64_t v)
+{
+  unsigned i;
+
+  for (i = 0; i < 2; i++)
+  {
+    d->lanes[i] += v * HASH_PRIME2;
+    d->lanes[i] = (d->lanes[i] << 31) | (d->lanes[i] >> 33);
+    d->lanes[i] *= HASH_PRIME1;
+  }
+  d->words++;
+}
+
+/* ================================================================ */
+/* Final avalanche of MurmurHash3 (fmix64), every bit of the result */
+/* depends on every bit of h.                                       */
+/* ================================================================ */
+uint64_t
+digest_fmix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+/* ================================================================ */
+/* Finish a digest: the number of words is mixed in, then the lanes */
+/* are combined and avalanched as in MurmurHash3_x64_128.           */
+/* ================================================================ */
+void
+digest_final(digest_t * d)
+{
+  d->lanes[0] ^= d->words;
+  d->lanes[1] ^= d->words;
+  d->lanes[0] += d->lanes[1];
+  d->lanes[1] += d->lanes[0];
+  d->lanes[0] = digest_fmix(d->lanes[0]);
+  d->lanes[1] = digest_fmix(d->lanes[1]);
+  d->lanes[0] += d->lanes[1];
+  d->lanes[1] += d->lanes[0];
+}
+
+/* ================================================================= */
+/* Compute the digest of a new attribute structure. Only what is     */
+/* shown by attrs_print counts, so that attributes displayed the     */
+/* same way have the same digest.                                    */
+/* ================================================================= */
+void
+attrs_hash(attrs_bytes_t * attrs)
+{
+  size_t   i, offset;
+  digest_t d;
+
+  offset = memspn((char *)attrs->bytes, attrs->len, "\0", 1);
+  if (offset == attrs->len && attrs->fg == 0 && attrs->bg == 0)
+  {
+    attrs->hash = 0;
+    return;
+  }
+
+  digest_init(&d);
+  for (i = offset; i < attrs->len; i++)
+    digest_add(&d, attrs->bytes[i]);
+  digest_add(&d, ((uint64_t)attrs->fg << 32) | attrs->bg);
+  digest_final(&d);
+
+  attrs->hash = d.lanes[0] | 1; /* never 0 */
+}
+
+/* ================================================================= */
+/* Find attributes equal to *attrs, whose digest is computed, in the */
+/* table of the attribute structures or add a copy of them.          */
+/* Returns the structure to reference from the cells.                */
+/* ================================================================= */
+attrs_bytes_t *
+attrs_intern(attrs_bytes_t * attrs)
+{
+  attrs_bytes_t *  a;
+  attrs_bytes_t ** old;
+  unsigned         h, b, mask;
+  unsigned         old_len;
+
+  /* Keep the hash table at most half full */
+  /* """"""""""""""""""""""""""""""""""""" */
+  if (2 * (attrs_nb + 1) > attrs_buckets_len)
+  {
+    old     = attrs_buckets;
+    old_len = attrs_buckets_len;
+
+    attrs_buckets_len = old_len ? old_len * 2 : 64;
+    attrs_buckets     = xcalloc(attrs_buckets_len, sizeof(attrs_bytes_t *));
+    heap_charge(sizeof(attrs_bytes_t *) * (attrs_buckets_len - old_len));
+
+    mask = attrs_buckets_len - 1;
+    for (b = 0; b < old_len; b++)
+    {
+      if (old[b] == NULL)
+        continue;
+
+      h = old[b]->hash & mask;
+      while (attrs_buckets[h] != NULL)
+        h = (h + 1) & mask;
+      attrs_buckets[h] = old[b];
+    }
+    free(old);
+  }
+
+  mask = attrs_buckets_len - 1;
+  h    = attrs->hash & mask;
+  while ((a = attrs_buckets[h]) != NULL)
+  {
+    if (a->hash == attrs->hash && a->len == attrs->len && a->fg == attrs->fg
+        && a->bg == attrs->bg && memcmp(a->bytes, attrs->bytes, a->len) == 0)
+      return a;
+
+    h = (h + 1) & mask;
+  }
+
+  /* Not found, the structure and its bytes are carved in one block */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  a        = arena_alloc(sizeof(attrs_bytes_t) + attrs->len);
+  *a       = *attrs;
+  a->bytes = (unsigned char *)(a + 1);
+  memcpy(a->bytes, attrs->bytes, attrs->len);
+
+  attrs_buckets[h] = a;
+  attrs_nb++;
+
+  return a;
+}
+
+/* ================================================================= */
+/* Returns the digest of the characters and attributes of a line.    */
+/* It is kept in the line until the line is changed, so a final      */
+/* digest only hashes again the lines written since the previous one */
+/* and the lines shared by snapshots are hashed once.                */
+/* ================================================================= */
+digest_t *
+line_hash(line_t * line)
+{
+  unsigned   i, j, n;
+  unsigned * cps;
+  digest_t * d = &line->hash;
+
+  if (line->hashed)
+    return d;
+
+  digest_init(d);
+  digest_add(d, line->length);
+  for (i = 0; i < line->length; i++)
+  {
+    cps = cluster_get(&line->cells[i].cp, &n);
+    for (j = 0; j < n; j++)
+      digest_add(d, cps[j]);
+
+    if (line->cells[i].attrs != NULL && line->cells[i].cp != WIDE_CONT)
+      digest_add(d, line->cells[i].attrs->hash);
+    else
+      digest_add(d, 0);
+  }
+  digest_final(d);
 
-    case VTPARSE_ACTION_ESC_DISPATCH:
-      switch (ch)
+  line->hashed = 1;
+
+  return d;
+}
+
+/* ================================================================= */
+/* Compute the digest of a screen: the rows shown by display and the */
+/* cursor position.                                                  */
+/* OUT: d receives the digest.                                       */
+/* ================================================================= */
+void
+screen_hash(screen_t * screen, digest_t * d)
+{
+  snapshot_t snap;
+  digest_t * line_d;
+  unsigned   row, last;
+
+  snapshot_take(screen, &snap);
+
+  last = snap.height;
+  while (last > 0 && snap.lines[last - 1]->length == 0)
+    last--;
+  last = last > 0 ? last - 1 : snap.rows - 1;
+
+  digest_init(d);
+  for (row = 0; row <= last; row++)
+  {
+    line_d = line_hash(snap.lines[row]);
+    digest_add(d, line_d->lanes[0]);
+    digest_add(d, line_d->lanes[1]);
+  }
+  digest_add(d, ((uint64_t)snap.cursor_row << 32) | screen->column);
+  digest_final(d);
+
+  snapshot_release(&snap);
+}
+
+/* ================================================================ */
+/* Screen display, only the first non-empty lines will be displayes */
+/*                                                                  */
+/* screen    (IN): screen to display                                */
+/* frame_opt (IN): 1: display some screen meta-data, 0 omit them    */
+/* ================================================================ */
+void
+display(screen_t * screen, unsigned frame_opt)
+{
+  snapshot_t snap;
+  line_t *   line;
+  char *     string;
+  unsigned   row, last;
+  unsigned   n = 1;
+
+  if (frame_opt)
+  {
+    fputs("--- virtual display top ---\n", output);
+
+    if (title != NULL)
+      fprintf(output, "title: %s\n", title);
+
+    for (n = 0; n < links_nb; n++)
+      fprintf(output, "link: %s\n", links[n]);
+    n = 1;
+  }
+
+  snapshot_take(screen, &snap);
+
+  /* Find the latest non-empty line in the virtual screen, all the */
+  /* rows are displayed if there is none.                          */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  last = snap.height;
+  while (last > 0 && snap.lines[last - 1]->length == 0)
+    last--;
+  last = last > 0 ? last - 1 : snap.rows - 1;
+
+  /* Displays the used lines from the top of the virtual screen */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  for (row = 0; row <= last; row++, n++)
+  {
+    /* Blank rows, most of a tall screen, are output as is */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""" */
+    line   = snap.lines[row];
+    string = line->length == 0 ? "" : line_string(line);
+    if (frame_opt)
+    {
+      if (row == snap.cursor_row)
+        fprintf(output, "%3d:-%s|\n", n, string); /* Current line */
+      else
+        fprintf(output, "%3d:|%s|\n", n, string);
+    }
+    else
+      fprintf(output, "%s\n", string);
+
+    if (!no_attr)
+    {
+      size_t i;
+
+      for (i = 0; i < line->length; i++)
+        attrs_print(line->cells, i);
+      fputc('\n', output);
+    }
+  }
+  if (frame_opt)
+    fputs("--- virtual display bottom ---\n", output);
+
+  snapshot_release(&snap);
+}
+
+/* ================================================================= */
+/* Convert a 1 based row or column index of the region option to an  */
+/* index from 0, a negative one counts from the end: -1 is size - 1. */
+/* The result is clamped to [0, size], size means out of bounds.     */
+/* ================================================================= */
+int
+region_bound(int index, unsigned size)
+{
+  long i = index > 0 ? (long)index - 1 : (long)size + index;
+
+  return i < 0 ? 0 : i > (long)size ? (int)size : (int)i;
+}
+
+/* ================================================================= */
+/* Output the cells of the rows top to bottom and of the columns     */
+/* left to right of the screen s, followed for each row by its       */
+/* attribute line unless -n is given. The indexes are counted from   */
+/* 1, the negative ones from the bottom row and the right column.    */
+/* The right column is the last one of the screen with -c, otherwise */
+/* the last one of each line. Only the rows of the region are        */
+/* visited, from the nearest end of the screen, and the cells past   */
+/* the end of a line are not output. The columns of the attribute    */
+/* lines are counted from the left column of the region.             */
+/* ================================================================= */
+void
+region_print(screen_t * s, int top, int left, int bottom, int right)
+{
+  ll_node_t * node;
+  line_t *    line;
+  unsigned *  cps;
+  unsigned    first, last, row, from, to, cols, i, j, n;
+  char        utf8[5];
+
+  first = region_bound(top, s->height);
+  last  = region_bound(bottom, s->height);
+  if (last == s->height)
+    last--;
+  if (first > last)
+    return;
+
+  if (first < s->height - last)
+    for (node = s->top, row = 0; row < first; row++)
+      node = node->next;
+  else
+    for (node = s->bottom, row = s->height - 1; row > first; row--)
+      node = node->prev;
+
+  for (row = first; row <= last && node != NULL; row++, node = node->next)
+  {
+    line = (line_t *)node->data;
+    cols = width ? width : line->length;
+    from = region_bound(left, cols);
+    to   = region_bound(right, cols) + 1;
+    if (to > line->length)
+      to = line->length;
+
+    /* A wide character cut by the left or the right column is     */
+    /* shown as a blank, so that each row keeps the region's width. */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    for (i = from; i < to; i++)
+    {
+      if (line->cells[i].cp == WIDE_CONT)
       {
-        unsigned n;
+        if (i == from)
+          fputc(' ', output);
+        continue;
+      }
 
-        case '7': /* Save cursor position and attributes DECSC */
-          screen.saved_row = 0;
-          node             = screen.current;
-          while (node != screen.top)
-          {
-            screen.saved_row++;
-            node = node->prev;
-          }
-          screen.saved_column = screen.column;
-          break;
+      if (i + 1 == to && to < line->length
+          && line->cells[to].cp == WIDE_CONT)
+      {
+        fputc(' ', output);
+        continue;
+      }
+
+      cps = cluster_get(&line->cells[i].cp, &n);
+      for (j = 0; j < n; j++)
+      {
+        utf8[utf8_encode(cps[j], utf8)] = '\0';
+        fputs(utf8, output);
+      }
+    }
+    fputc('\n', output);
+
+    if (!no_attr)
+    {
+      for (i = from; i < to; i++)
+        attrs_print(line->cells + from, i - from);
+      fputc('\n', output);
+    }
+  }
+}
+
+/* =========================================================== */
+/* Output the active screen, only its region with -r or only   */
+/* its digest with -d                                          */
+/* =========================================================== */
+void
+screen_show(void)
+{
+  digest_t d;
+
+  if (region_opt)
+    region_print(screen, region[0], region[1], region[2], region[3]);
+  else if (digest_opt)
+  {
+    screen_hash(screen, &d);
+    fprintf(output, "%016llx%016llx\n", (unsigned long long)d.lanes[1],
+            (unsigned long long)d.lanes[0]);
+  }
+  else
+    display(screen, frame_opt);
+}
+
+/* ================================================================ */
+/* SIGUSR1 handler, the snapshot is only output at the next safe    */
+/* point.                                                           */
+/* ================================================================ */
+void
+snapshot_signal(int sig)
+{
+  int     saved_errno = errno;
+  ssize_t rc;
+
+  (void)sig;
+  snapshot_wanted = 1;
+
+  /* Fails only when the pipe is full, a wake up is then pending */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  rc = write(snapshot_pipe[1], "", 1);
+  (void)rc;
+
+  errno = saved_errno;
+}
+
+/* ================================================================= */
+/* Create the pipe written by the SIGUSR1 handler. Neither end must  */
+/* block, nor be inherited by the command run by hlvt.               */
+/* ================================================================= */
+void
+snapshot_pipe_open(void)
+{
+  int flags;
+  int i;
+
+  if (pipe(snapshot_pipe) < 0)
+  {
+    fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < 2; i++)
+    if ((flags = fcntl(snapshot_pipe[i], F_GETFL)) < 0
+        || fcntl(snapshot_pipe[i], F_SETFL, flags | O_NONBLOCK) < 0
+        || fcntl(snapshot_pipe[i], F_SETFD, FD_CLOEXEC) < 0)
+    {
+      fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+}
+
+/* ================================================================= */
+/* Read the commands available on the control file descriptor, one   */
+/* per line. It is closed at its end of file or on error.            */
+/* ================================================================= */
+void
+control_read(void)
+{
+  char    buf[256];
+  ssize_t bytes;
+  ssize_t i;
+
+  while ((bytes = read(control_fd, buf, sizeof(buf))) > 0)
+    for (i = 0; i < bytes; i++)
+    {
+      if (buf[i] != '\n')
+      {
+        if (control_len < sizeof(control_line) - 1)
+          control_line[control_len++] = buf[i];
+        continue;
+      }
+
+      control_line[control_len] = '\0';
+      control_len               = 0;
+
+      if (strcmp(control_line, "snapshot") == 0)
+        snapshot_wanted = 1;
+      else if (control_line[0] != '\0')
+        fprintf(stderr, "%s: %s: unknown command\n", prog, control_line);
+    }
+
+  if (bytes == 0 || (errno != EAGAIN && errno != EINTR))
+  {
+    close(control_fd);
+    control_fd = -1;
+  }
+}
+
+/* ================================================================= */
+/* Output the screen if a snapshot has been requested. Only called   */
+/* between two calls to vtparse, where the screen is consistent.     */
+/* ================================================================= */
+void
+snapshot_check(void)
+{
+  char buf[64];
+
+  if (control_fd >= 0)
+    control_read();
+
+  if (!snapshot_wanted)
+    return;
+
+  /* The handler has written its byte before it returned */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""" */
+  while (read(snapshot_pipe[0], buf, sizeof(buf)) > 0)
+    ;
+
+  snapshot_wanted = 0;
+  screen_show();
+  fflush(output);
+}
+
+/* ================================================================= */
+/* read() on the typescript which outputs the requested snapshots    */
+/* while it waits. The typescript is only read once poll has found   */
+/* it readable, poll also watches the control file descriptor, if    */
+/* any, and the pipe written by the SIGUSR1 handler.                 */
+/* ================================================================= */
+ssize_t
+input_read(int fd, unsigned char * buf, size_t size)
+{
+  struct pollfd pfd[3];
+  ssize_t       bytes;
+
+  pfd[0].fd     = fd;
+  pfd[0].events = POLLIN;
+  pfd[1].events = POLLIN;
+  pfd[2].fd     = snapshot_pipe[0];
+  pfd[2].events = POLLIN;
+
+  for (;;)
+  {
+    snapshot_check();
+
+    pfd[1].fd = control_fd; /* ignored by poll when -1 */
+    if (poll(pfd, 3, -1) < 0 ? errno == EINTR : pfd[0].revents == 0)
+      continue;
+
+    bytes = read(fd, buf, size);
+    if (bytes >= 0 || errno != EINTR)
+      return bytes;
+  }
+}
+
+/* ================================================================= */
+/* read() restarted when interrupted, for the parsing thread of the  */
+/* pipelined mode which leaves the snapshots to the other one.       */
+/* ================================================================= */
+ssize_t
+read_retry(int fd, unsigned char * buf, size_t size)
+{
+  ssize_t bytes;
+
+  while ((bytes = read(fd, buf, size)) < 0 && errno == EINTR)
+    ;
+
+  return bytes;
+}
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+/* ============================================================ */
+/* Report a compressed typescript which cannot be read further, */
+/* the screen is still displayed.                               */
+/* ============================================================ */
+void
+source_truncated(const char * reason)
+{
+  fprintf(stderr, "%s: %s, the input is truncated\n", prog, reason);
+}
+
+/* ================================================================= */
+/* Inflate up to size bytes of a gzip typescript into buf, the       */
+/* concatenated members are read in sequence. Returns the number of  */
+/* bytes produced, 0 at the end or on error and -1 on read error.    */
+/* ================================================================= */
+ssize_t
+source_gunzip(source_t * src, unsigned char * buf, size_t size)
+{
+  z_stream * zs = &src->zs;
+  ssize_t    bytes;
+  int        rc;
+
+  zs->next_out  = buf;
+  zs->avail_out = size > UINT_MAX ? UINT_MAX : size;
+  size          = zs->avail_out;
+
+  while (zs->avail_out == size)
+  {
+    if (zs->avail_in == 0)
+    {
+      if (src->end)
+        break;
+
+      bytes = src->read(src->fd, src->in, INPUT_CHUNK);
+      if (bytes < 0)
+        return -1;
+
+      src->end     = bytes == 0;
+      zs->next_in  = src->in;
+      zs->avail_in = bytes;
+      continue;
+    }
+
+    /* Another member follows the end of the previous one */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (!src->member)
+    {
+      inflateReset(zs);
+      src->member = 1;
+    }
+
+    rc = inflate(zs, Z_NO_FLUSH);
+    if (rc == Z_STREAM_END)
+      src->member = 0;
+    else if (rc != Z_OK && rc != Z_BUF_ERROR)
+    {
+      source_truncated(zs->msg != NULL ? zs->msg : "gzip error");
+      src->end      = 1;
+      src->member   = 0;
+      zs->avail_in  = 0;
+      break;
+    }
+  }
+
+  if (src->end && zs->avail_in == 0 && src->member)
+  {
+    source_truncated("unexpected end of gzip data");
+    src->member = 0;
+  }
+
+  return size - zs->avail_out;
+}
+#endif
+
+/* ================================================================= */
+/* Read the next bytes of the typescript into buf, inflated if the   */
+/* typescript is compressed. The format is detected on the first     */
+/* call, these bytes are then the only ones copied. Returns like     */
+/* read().                                                           */
+/* ================================================================= */
+ssize_t
+source_read(source_t * src, unsigned char * buf, size_t size)
+{
+  ssize_t bytes;
+
+  if (!src->started)
+  {
+    src->started = 1;
+    src->in      = xmalloc(INPUT_CHUNK);
+
+    /* The two magic bytes may come in two reads from a pipe */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
+    while (src->in_len < 2)
+    {
+      bytes = src->read(src->fd, src->in + src->in_len,
+                        INPUT_CHUNK - src->in_len);
+      if (bytes < 0)
+        return -1;
+      if (bytes == 0)
+      {
+        src->end = 1;
+        break;
+      }
+      src->in_len += bytes;
+    }
+
+    src->gzip = src->in_len >= 2 && src->in[0] == 0x1f && src->in[1] == 0x8b;
+
+    if (src->gzip)
+    {
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+      memset(&src->zs, 0, sizeof(src->zs));
+      if (inflateInit2(&src->zs, 16 + MAX_WBITS) != Z_OK)
+      {
+        fprintf(stderr, "%s: cannot initialize zlib\n", prog);
+        exit(EXIT_FAILURE);
+      }
+      src->zs.next_in  = src->in;
+      src->zs.avail_in = src->in_len;
+      src->member      = 1;
+#else
+      fprintf(stderr, "%s: gzip typescripts are not supported by this build\n",
+              prog);
+      exit(EXIT_FAILURE);
+#endif
+    }
+  }
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+  if (src->gzip)
+    return source_gunzip(src, buf, size);
+#endif
+
+  /* The bytes read for the detection come first */
+  /* """"""""""""""""""""""""""""""""""""""""""" */
+  if (src->in_pos < src->in_len)
+  {
+    bytes = src->in_len - src->in_pos < size ? src->in_len - src->in_pos
+                                             : size;
+    memcpy(buf, src->in + src->in_pos, bytes);
+    src->in_pos += bytes;
+    return bytes;
+  }
+
+  if (src->end)
+    return 0;
+
+  return src->read(src->fd, buf, size);
+}
+
+/* ============================================= */
+/* Release the buffers and the zlib state if any */
+/* ============================================= */
+void
+source_close(source_t * src)
+{
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+  if (src->gzip)
+    inflateEnd(&src->zs);
+#endif
+
+  free(src->in);
+}
+
+/* ================================================================ */
+/* Wait a little for the other thread of the pipeline, the first    */
+/* waits only yield the processor.                                  */
+/* ================================================================ */
+void
+pipeline_wait(unsigned * spins)
+{
+  struct timespec pause = { 0, 50000 };
+
+  if ((*spins)++ < 64)
+    sched_yield();
+  else
+    nanosleep(&pause, NULL);
+}
+
+/* ================================================================= */
+/* Return a record of size bytes in the chunk being filled. The      */
+/* chunk is published and the next free one is waited for when it   */
+/* is full.                                                          */
+/* ================================================================= */
+pipeline_action_t *
+pipeline_reserve(size_t size)
+{
+  pipeline_chunk_t * chunk = pipeline.current;
+  unsigned           spins = 0;
+  size_t             pos;
+
+  assert(size <= PIPELINE_CHUNK);
+
+  pipeline.run = NULL;
+
+  if (chunk != NULL && PIPELINE_ROUND(chunk->len) + size > PIPELINE_CHUNK)
+  {
+    pipeline_publish();
+    chunk = NULL;
+  }
+
+  if (chunk == NULL)
+  {
+    while (pipeline.head - __atomic_load_n(&pipeline.tail, __ATOMIC_ACQUIRE)
+           == PIPELINE_CHUNKS)
+      pipeline_wait(&spins);
+
+    chunk = pipeline.current = &pipeline.chunks[pipeline.head
+                                                % PIPELINE_CHUNKS];
+    chunk->len = 0;
+  }
+
+  pos        = PIPELINE_ROUND(chunk->len);
+  chunk->len = pos + size;
+
+  return (pipeline_action_t *)(chunk->data + pos);
+}
+
+/* ================================================ */
+/* Hand the chunk being filled over to the consumer */
+/* ================================================ */
+void
+pipeline_publish(void)
+{
+  if (pipeline.current == NULL)
+    return;
+
+  pipeline.current = NULL;
+  pipeline.run     = NULL;
+  __atomic_store_n(&pipeline.head, pipeline.head + 1, __ATOMIC_RELEASE);
+}
+
+/* ================================================================= */
+/* Parser callback of the producer, the actions are only recorded.   */
+/* A printed byte directly following a run of printed bytes is       */
+/* appended to its record.                                           */
+/* ================================================================= */
+void
+pipeline_callback(vtparse_t * parser, vtparse_action_t action,
+                  unsigned char ch)
+{
+  pipeline_action_t * a = pipeline.run;
+  unsigned char *     data;
+  unsigned            n   = 0;
+  unsigned            len = 0;
+  unsigned            pos;
+  int                 i;
+
+  switch (action)
+  {
+    case VTPARSE_ACTION_PRINT:
+      if (a != NULL && a->offset + a->len == parser->offset
+          && pipeline.current->len < PIPELINE_CHUNK)
+      {
+        pipeline.current->data[pipeline.current->len++] = ch;
+        a->len++;
+        return;
+      }
+      len = 1;
+      break;
+
+    case VTPARSE_ACTION_OSC_PUT:
+    case VTPARSE_ACTION_PUT:
+      /* Without string limit (-s 0) a slice of the payload can be as */
+      /* large as a read, it is then recorded in several pieces.      */
+      /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+      for (pos = 0; pos < (unsigned)parser->string_data_len; pos += len)
+      {
+        len = parser->string_data_len - pos;
+        if (len > PIPELINE_STRING_MAX)
+          len = PIPELINE_STRING_MAX;
+
+        a = pipeline_reserve(sizeof(pipeline_action_t) + len);
+        memset(a, 0, sizeof(*a));
 
-        case '8': /* Restore cursor position and attributes DECSC */
-          n              = screen.saved_row;
-          screen.current = screen.top;
-          while (n > 0)
-          {
-            screen.current = screen.current->next;
-            n--;
-          }
-          screen.column = screen.saved_column;
-          break;
+        a->offset = parser->offset + pos;
+        a->action = action;
+        a->len    = len;
+        memcpy(a + 1, parser->string_data + pos, len);
+      }
+      return;
 
-        case 'E':
-          if (screen.current == screen.lines->tail)
-          {
-            ll_append(screen.lines, line_new());
-            screen.current = screen.lines->tail;
-            screen.top     = screen.top->next;
-            screen.bottom  = screen.current;
-          }
-          else
-          {
-            if (screen.current == screen.bottom)
-            {
-              screen.top    = screen.top->next;
-              screen.bottom = screen.bottom->next;
-            }
-            screen.current = screen.current->next;
-          }
-          screen.column = 0;
-          break;
+    case VTPARSE_ACTION_CSI_DISPATCH:
+    case VTPARSE_ACTION_HOOK:
+      n = parser->num_params;
+      break;
 
-        case 'D':
-          if (screen.current < screen.bottom)
-            screen.current = screen.current->next;
-          /* TODO: scroll up when the bottom of region is reached */
-          break;
+    default:
+      break;
+  }
 
-        case 'M':
-          if (screen.current > screen.top)
-            screen.current = screen.current->prev;
-          /* TODO: scroll down when the top of region is reached */
-          break;
+  a = pipeline_reserve(sizeof(pipeline_action_t) + n * sizeof(unsigned short)
+                       + len);
+  memset(a, 0, sizeof(*a));
 
-        default:
-          break;
-      }
+  a->offset     = parser->offset;
+  a->action     = action;
+  a->ch         = ch;
+  a->len        = len;
+  a->num_params = n;
+  data          = (unsigned char *)(a + 1) + n * sizeof(unsigned short);
+
+  switch (action)
+  {
+    case VTPARSE_ACTION_PRINT:
+      data[0]      = ch;
+      pipeline.run = a;
       break;
 
     case VTPARSE_ACTION_CSI_DISPATCH:
-      switch (ch)
-      {
-        case 'A': /* Move cursor up n lines CUU */
-          if (parser->num_params == 0)
-          {
-            if (screen.current > screen.top)
-              screen.current = screen.current->prev;
-          }
-          else
-            for (i = 0; i < parser->params[0]; i++)
-            {
-              if (screen.current > screen.top)
-                screen.current = screen.current->prev;
-              else
-                break;
-            }
-          break;
+    case VTPARSE_ACTION_HOOK:
+      a->subparams       = parser->subparams;
+      a->params_overflow = parser->params_overflow;
+      memcpy(a + 1, parser->params, n * sizeof(unsigned short));
+      /* fall through */
 
-        case 'B': /* Move cursor down n lines CUD */
-          if (parser->num_params == 0)
-          {
-            if (screen.current < screen.bottom)
-              screen.current = screen.current->next;
-          }
-          else
-            for (i = 0; i < parser->params[0]; i++)
-            {
-              if (screen.current < screen.bottom)
-                screen.current = screen.current->next;
-              else
-                break;
-            }
-          break;
+    case VTPARSE_ACTION_ESC_DISPATCH:
+      a->num_intermediates = parser->num_intermediate_chars;
+      for (i = 0; i < parser->num_intermediate_chars; i++)
+        a->intermediates[i] = parser->intermediate_chars[i];
+      break;
 
-        case 'C': /* Move cursor right n lines CUF */
-          if (parser->num_params == 0)
-            screen.column++;
-          else
-            for (i = 0; i < parser->params[0]; i++)
-              screen.column++;
-          break;
+    default:
+      break;
+  }
+}
 
-        case 'D': /* Move cursor left n lines CUB */
-          if (parser->num_params == 0)
-          {
-            if (screen.column > 0)
-              screen.column--;
-          }
-          else
-            for (i = 0; i < parser->params[0]; i++)
-            {
-              if (screen.column > 0)
-                screen.column--;
-              else
-                break;
-            }
-          break;
+/* ================================================================= */
+/* Producer thread: reads and parses the typescript until its end,   */
+/* the max_bytes limit or the stop of the consumer.                  */
+/* ================================================================= */
+void *
+pipeline_producer(void * arg)
+{
+  static unsigned char buf[INPUT_CHUNK];
 
-        case 'G': /* Move cursor - hpa */
-          if (parser->num_params != 1)
-            goto error;
+  vtparse_t * parser = arg;
+  int         bytes;
+  uint64_t    start;
 
-          if (parser->params[0] == 0)
-            screen.column = 0;
-          else
-            screen.column = parser->params[0] - 1;
-          break;
+  do
+  {
+    if (__atomic_load_n(&pipeline.stop, __ATOMIC_RELAXED))
+      break;
 
-        case 'f': /* Move cursor */
-        case 'H': /* Move cursor */
-          if (parser->num_params == 0)
-          {
-            /* To upper left corner - cursorhome */
-            screen.current = screen.top;
-            screen.column  = 0;
-          }
-          else /* Move cursor to screen location y,x - CUP */
-          {
-            unsigned x, y;
+    STAT_CLOCK(start);
+    bytes = source_read(&source, buf, INPUT_CHUNK);
+    STAT_TIME(start, pipeline.read_ns);
 
-            if (parser->num_params != 2)
-              goto error;
+    pipeline.limited = max_bytes && bytes > 0
+                       && (size_t)bytes > max_bytes - pipeline.total;
+    if (pipeline.limited)
+      bytes = max_bytes - pipeline.total;
 
-            y = parser->params[0];
-            x = parser->params[1];
+    pipeline.total += bytes > 0 ? bytes : 0;
 
-            /* x and y are 1 based byt treats 0 the same as 1 */
-            /* """""""""""""""""""""""""""""""""""""""""""""" */
-            if (x > 0)
-              x--;
-            if (y > 0)
-              y--;
+    vtparse(parser, buf, bytes);
 
-            if (y > 23)
-              y = 23;
+    /* A short read means that the typescript is read as it is written, */
+    /* the actions are then not held back until the chunk is full.      */
+    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (bytes > 0 && bytes < INPUT_CHUNK)
+      pipeline_publish();
+  } while (bytes > 0 && !pipeline.limited);
 
-            /* go down y lines from th first line */
-            /* """""""""""""""""""""""""""""""""" */
-            node = screen.top;
-            for (i = 0; i < y; i++)
-              node = node->next;
+  pipeline_publish();
+  __atomic_store_n(&pipeline.eof, 1, __ATOMIC_RELEASE);
 
-            screen.current = node;
-            screen.column  = x;
-          }
-          break;
+  return NULL;
+}
 
-        case 'J':
+/* ================================================================= */
+/* Give the actions recorded in a chunk to parser_callback, through  */
+/* parser which receives their parameters.                           */
+/* ================================================================= */
+void
+pipeline_apply(pipeline_chunk_t * chunk, vtparse_t * parser)
+{
+  pipeline_action_t * a;
+  unsigned char *     data;
+  size_t              pos;
+  unsigned            i;
+
+  for (pos = 0; pos < chunk->len && !stopped;
+       pos += PIPELINE_ROUND(sizeof(*a) + a->num_params * sizeof(unsigned short)
+                             + a->len))
+  {
+    a    = (pipeline_action_t *)(chunk->data + pos);
+    data = (unsigned char *)(a + 1) + a->num_params * sizeof(unsigned short);
+
+    parser->offset = a->offset;
+
+    switch (a->action)
+    {
+      case VTPARSE_ACTION_PRINT:
+        for (i = 0; i < a->len; i++)
         {
-          ll_node_t * start_node = screen.top;
-          ll_node_t * stop_node  = screen.bottom;
+          parser->offset = a->offset + i;
+          parser_callback(parser, VTPARSE_ACTION_PRINT, data[i]);
+        }
+        break;
 
-          if (parser->num_params == 0
-              || (parser->num_params == 1 && parser->params[0] == 0))
-          {
-            start_node = screen.current;
-            stop_node  = screen.bottom;
-          }
-          else if (parser->num_params == 1)
-          {
-            switch (parser->params[0])
-            {
-              case 1:
-                start_node = screen.top;
-                stop_node  = screen.current;
-                break;
+      case VTPARSE_ACTION_OSC_PUT:
+      case VTPARSE_ACTION_PUT:
+        parser->string_data     = data;
+        parser->string_data_len = a->len;
+        parser_callback(parser, a->action, a->ch);
+        break;
 
-              case 2:
-                start_node = screen.top;
-                stop_node  = screen.bottom;
-                break;
-            }
-          }
+      default:
+        parser->num_params             = a->num_params;
+        parser->subparams              = a->subparams;
+        parser->params_overflow        = a->params_overflow;
+        parser->num_intermediate_chars = a->num_intermediates;
+        memcpy(parser->params, a + 1, a->num_params * sizeof(unsigned short));
+        memcpy(parser->intermediate_chars, a->intermediates,
+               MAX_INTERMEDIATE_CHARS);
+        parser_callback(parser, a->action, a->ch);
+        break;
+    }
+  }
+}
 
-          node = start_node;
-          do
-          {
-            cl        = (line_t *)node->data;
-            cl->bytes = cl->length = 0;
-            cl->string[0]          = '\0';
-            node                   = node->next;
-          } while (node != NULL && node != stop_node);
-        }
+/* ================================================================= */
+/* Process the whole typescript with the parsing and the emulation   */
+/* in two threads. The output is the same as in the serial mode.     */
+/* Returns the number of bytes of typescript processed.              */
+/* ================================================================= */
+size_t
+pipeline_run(vtparse_t * parser)
+{
+  pthread_t          producer;
+  sigset_t           mask, old_mask;
+  vtparse_t          applied;
+  pipeline_chunk_t * chunk;
+  unsigned           spins = 0;
+  int                rc;
+
+  pipeline.chunks = xmalloc(PIPELINE_CHUNKS * sizeof(pipeline_chunk_t));
+
+  memset(&applied, 0, sizeof(applied));
+  applied.cb  = parser_callback;
+  parser->cb  = pipeline_callback;
+  source.read = read_retry;
+
+  /* The snapshots are requested to the emulation thread only */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  rc = pthread_create(&producer, NULL, pipeline_producer, parser);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  if (rc != 0)
+  {
+    fprintf(stderr, "%s: %s\n", prog, strerror(rc));
+    exit(EXIT_FAILURE);
+  }
+
+  /* The chunks are still consumed after a stop so that the producer */
+  /* never waits for ever.                                           */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  for (;;)
+  {
+    if (pipeline.tail == __atomic_load_n(&pipeline.head, __ATOMIC_ACQUIRE))
+    {
+      if (__atomic_load_n(&pipeline.eof, __ATOMIC_ACQUIRE)
+          && pipeline.tail
+               == __atomic_load_n(&pipeline.head, __ATOMIC_ACQUIRE))
         break;
 
-        case 'K': /* Clear line */
-        {
-          unsigned n;
-          unsigned pos;
+      snapshot_check();
+      pipeline_wait(&spins);
+      continue;
+    }
 
-          cl = (line_t *)screen.current->data;
-          n  = find_nth_char(cl->string, cl->bytes, screen.column, &pos);
-          if (parser->num_params == 0
-              || (parser->num_params == 1 && parser->params[0] == 0))
-          {
-            cl->bytes       = pos;
-            cl->length      = n;
-            cl->string[pos] = '\0';
-          }
-          else
-            switch (parser->params[0])
-            {
-              case 1:
-                /* from cursor left EL1 */
-                for (i = 0; i < pos; i++)
-                  cl->string[i] = ' ';
-                break;
-              case 2:
-                /* from entire line EL2 */
-                for (i = 0; i < cl->bytes; i++)
-                  cl->string[i] = ' ';
-                cl->bytes = cl->length = 0;
-                cl->string[0]          = '\0';
+    spins = 0;
+    chunk = &pipeline.chunks[pipeline.tail % PIPELINE_CHUNKS];
+    if (!stopped)
+    {
+      pipeline_apply(chunk, &applied);
+      snapshot_check();
+    }
+    if (stopped)
+      __atomic_store_n(&pipeline.stop, 1, __ATOMIC_RELAXED);
 
-                break;
-            }
-          break;
-        }
+    __atomic_store_n(&pipeline.tail, pipeline.tail + 1, __ATOMIC_RELEASE);
+  }
 
-        case 'm':
-          if (!no_attr)
-          {
-            if (parser->num_params == 0
-                || (parser->num_params == 1 && parser->params[0] == '\0'))
-            {
-              curr_attrs_bytes.len      = 1;
-              curr_attrs_bytes.bytes[0] = '\0';
-            }
-            else
-            {
-              /* The current attribute structure is empty */
-              /* """""""""""""""""""""""""""""""""""""""" */
-              if (curr_attrs_bytes.bytes[0] == '\0')
-              {
-                curr_attrs_bytes.len = parser->num_params;
-                curr_attrs_bytes.bytes =
-                  xrealloc(curr_attrs_bytes.bytes, curr_attrs_bytes.len);
+  pthread_join(producer, NULL);
+  free(pipeline.chunks);
 
-                for (i = 0; i < parser->num_params; i++)
-                  curr_attrs_bytes.bytes[i] = parser->params[i];
-                qsort(curr_attrs_bytes.bytes, parser->num_params, 1, compar);
-              }
-              else
-              {
-                /* The current attribute structure already contains */
-                /* some attributes, we need to merge the new ones   */
-                /* """""""""""""""""""""""""""""""""""""""""""""""" */
-                unsigned char * bytes;
-                int             len;
-
-                bytes = xmalloc(curr_attrs_bytes.len + parser->num_params);
-                qsort(parser->params, parser->num_params, 1, compar);
-                len = attrs_merge(curr_attrs_bytes.bytes, curr_attrs_bytes.len,
-                                  parser->params, parser->num_params, bytes);
-                bytes = xrealloc(bytes, len);
-                free(curr_attrs_bytes.bytes);
-
-                curr_attrs_bytes.len   = len;
-                curr_attrs_bytes.bytes = bytes;
-              }
-            }
-          }
-          break;
+  STAT_ADD(read_ns, pipeline.read_ns);
+
+  if (pipeline.limited)
+    limit_reached("input size");
+
+  return pipeline.total;
+}
+
+/* ============================================ */
+/* Copy the state of the emulator to a session  */
+/* ============================================ */
+void
+emulator_save(emulator_t * e)
+{
+#define X(v) memcpy(&e->v, &v, sizeof(v));
+  EMULATOR_STATE
+#undef X
+}
+
+/* ================================================ */
+/* Make the state of a session the one of emulator  */
+/* ================================================ */
+void
+emulator_load(emulator_t * e)
+{
+#define X(v) memcpy(&v, &e->v, sizeof(v));
+  EMULATOR_STATE
+#undef X
+}
+
+/* ================================================================= */
+/* Release the memory used by the current state of the emulator, it  */
+/* must be loaded again before being used.                           */
+/* ================================================================= */
+void
+emulator_free(void)
+{
+  unsigned i;
+
+  free(main_screen.lines);
+  free(main_screen.tabs);
+  free(alt_screen.lines);
+  free(alt_screen.tabs);
+
+  free(clusters.cps);
+  free(clusters.starts);
+  free(clusters.buckets);
+  free(attrs_buckets);
+
+  free(osc);
+  free(title);
+  for (i = 0; i < links_nb; i++)
+    free(links[i]);
+  free(links);
+  free(links_buckets);
+
+  arena_release();
+}
+
+/* ================================================================= */
+/* Create a session for the connection fd, with a new screen of      */
+/* height lines.                                                     */
+/* ================================================================= */
+session_t *
+session_new(int fd, unsigned height, unsigned string_limit)
+{
+  session_t * s = xcalloc(1, sizeof(session_t));
+
+  s->fd       = fd;
+  s->emulator = emulator_initial;
+
+  emulator_load(&s->emulator);
+  screen_init(&main_screen, height);
+  emulator_save(&s->emulator);
+
+  vtparse_init(&s->parser, parser_callback);
+  s->parser.string_limit = string_limit;
+
+  return s;
+}
+
+/* ================================================================= */
+/* Process the bytes available on the connection. Only one read is   */
+/* done per call so that a busy client cannot hold the daemon.       */
+/* Returns 1 if more bytes are expected, 0 at the end of the input   */
+/* and -1 on error.                                                  */
+/* ================================================================= */
+int
+session_input(session_t * s)
+{
+  static unsigned char buf[65536];
+
+  ssize_t bytes;
+  int     limited;
+
+  bytes = read(s->fd, buf, sizeof(buf));
+  if (bytes < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 1 : -1;
+  if (bytes == 0)
+    return 0;
+
+  emulator_load(&s->emulator);
+
+  if (!stopped)
+  {
+    limited = max_bytes && (size_t)bytes > max_bytes - s->total;
+    if (limited)
+      bytes = max_bytes - s->total;
+
+    s->total += bytes;
+    vtparse(&s->parser, buf, bytes);
+
+    if (limited)
+      limit_reached("input size");
+  }
+
+  emulator_save(&s->emulator);
+
+  return 1;
+}
+
+/* ================================================================= */
+/* Build the reply of a session from its final screen, the emulator  */
+/* state is then released.                                           */
+/* ================================================================= */
+void
+session_render(session_t * s)
+{
+  emulator_load(&s->emulator);
+
+  output = open_memstream(&s->reply, &s->reply_len);
+  if (output == NULL)
+  {
+    fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  screen_show();
+
+  fclose(output);
+  output = stdout;
+
+  emulator_free();
+}
+
+/* ================================================================= */
+/* Send what the socket accepts of the reply.                        */
+/* Returns 1 if some bytes remain to be sent, 0 when the reply has   */
+/* been sent and -1 on error.                                        */
+/* ================================================================= */
+int
+session_reply(session_t * s)
+{
+  ssize_t n;
 
-        default:
-          break;
-      }
-      break;
+  while (s->sent < s->reply_len)
+  {
+    n = write(s->fd, s->reply + s->sent, s->reply_len - s->sent);
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 1
+                                                                        : -1;
+    s->sent += n;
+  }
 
-    case VTPARSE_ACTION_EXECUTE:
-      switch (ch)
-      {
-        case 0x0d: /* Carriage return */
-          screen.column = 0;
-          break;
+  return 0;
+}
 
-        case 0x08: /* Backspace */
-          if (screen.column > 0)
-            screen.column--;
-          break;
+/* ================================================================= */
+/* Close the connection and release the session, its emulator state  */
+/* is released too if the reply has not been built.                  */
+/* ================================================================= */
+void
+session_free(session_t * s)
+{
+  if (s->reply == NULL)
+  {
+    emulator_load(&s->emulator);
+    emulator_free();
+  }
 
-        case 0x09: /* Tab */
-          /* FIXME: for now assume a hard coded tab each 8 characters */
-          /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-          screen.column = (screen.column + 8) / 8 * 8;
-          break;
+  close(s->fd);
+  free(s->reply);
+  free(s);
+}
 
-        case 0x0a: /* Line feed */
-          if (screen.current == screen.lines->tail)
-          {
-            ll_append(screen.lines, line_new());
-            screen.current = screen.lines->tail;
-            screen.top     = screen.top->next;
-            screen.bottom  = screen.current;
-          }
-          else
-          {
-            if (screen.current == screen.bottom)
-            {
-              screen.top    = screen.top->next;
-              screen.bottom = screen.bottom->next;
-            }
-            screen.current = screen.current->next;
-          }
-          screen.column = 0;
-          break;
-      }
-      break;
+/* ================================================================= */
+/* Daemon mode: accept connections on the Unix socket path and       */
+/* process their typescripts concurrently, driven by epoll. Each     */
+/* connection gets its own screen with the options given to hlvt.    */
+/* A stale socket left at path is replaced. Never returns.           */
+/* ================================================================= */
+void
+serve(const char * path, unsigned height, unsigned string_limit)
+{
+  struct sockaddr_un addr;
+  struct stat        st;
+  struct epoll_event ev;
+  struct epoll_event events[64];
+  session_t *        s;
+  int                lfd, efd, fd;
+  int                i, n, rc;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: %s: path too long\n", prog, path);
+    exit(EXIT_FAILURE);
+  }
 
-    case VTPARSE_ACTION_CLEAR:
-      break;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
 
-    case VTPARSE_ACTION_COLLECT:
-      break;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
 
-    case VTPARSE_ACTION_HOOK:
-      break;
+  if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+      || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(lfd, SOMAXCONN) < 0
+      || fcntl(lfd, F_SETFL, O_NONBLOCK) < 0
+      || (efd = epoll_create(64)) < 0)
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
 
-    case VTPARSE_ACTION_UNHOOK:
-      break;
+  /* A client leaving before its reply must not kill the daemon */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  signal(SIGPIPE, SIG_IGN);
 
-    case VTPARSE_ACTION_OSC_END:
-      break;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL; /* the listening socket */
+  epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev);
 
-    case VTPARSE_ACTION_OSC_PUT:
-      break;
+  emulator_save(&emulator_initial);
 
-    case VTPARSE_ACTION_OSC_START:
-      break;
+  for (;;)
+  {
+    n = epoll_wait(efd, events, 64, -1);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
 
-    case VTPARSE_ACTION_PARAM:
-      break;
+    for (i = 0; i < n; i++)
+    {
+      s = events[i].data.ptr;
 
-    case VTPARSE_ACTION_PUT:
-      break;
+      /* New connections */
+      /* """"""""""""""" */
+      if (s == NULL)
+      {
+        while ((fd = accept(lfd, NULL, NULL)) >= 0)
+        {
+          fcntl(fd, F_SETFL, O_NONBLOCK);
+          s           = session_new(fd, height, string_limit);
+          ev.events   = EPOLLIN;
+          ev.data.ptr = s;
+          if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            session_free(s);
+        }
 
-    case VTPARSE_ACTION_IGNORE:
-      break;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+        continue;
+      }
 
-    case VTPARSE_ACTION_ERROR:
-    error:
-      fprintf(stderr, "ch: %c\n", ch);
-      exit(1);
-      break;
-  }
-#if 0
-    default:
-      printf("Received action %s %d\n", ACTION_NAMES[action], action);
-      if (ch != 0)
-        printf("Char: 0x%02x ('%c')\n", ch, ch);
-      if (parser->num_intermediate_chars > 0)
+      /* Typescript to read or reply to send */
+      /* """"""""""""""""""""""""""""""""""" */
+      if (s->reply == NULL)
       {
-        printf("%d Intermediate chars:\n", parser->num_intermediate_chars);
-        for (i = 0; i < parser->num_intermediate_chars; i++)
-          printf("  0x%02x ('%c')\n", parser->intermediate_chars[i],
-                 parser->intermediate_chars[i]);
+        rc = session_input(s);
+        if (rc == 0)
+        {
+          session_render(s);
+          ev.events   = EPOLLOUT;
+          ev.data.ptr = s;
+          epoll_ctl(efd, EPOLL_CTL_MOD, s->fd, &ev);
+          rc = session_reply(s);
+          rc = rc == 0 ? -1 : rc; /* everything sent, close */
+        }
       }
-      if (parser->num_params > 0)
+      else
       {
-        printf("%d Parameters:\n", parser->num_params);
-        for (i = 0; i < parser->num_params; i++)
-          printf("\t%d\n", parser->params[i]);
+        rc = session_reply(s);
+        rc = rc == 0 ? -1 : rc;
       }
 
-      printf("\n");
-      break;
-#endif
+      if (rc < 0)
+        session_free(s); /* closing fd also removes it from epoll */
+    }
+  }
 }
 
 /* ================================================================ */
-/* Screen display, only the first non-empty lines will be displayes */
-/*                                                                  */
-/* screen    (IN): screen to display                                */
-/* frame_opt (IN): 1: display some screen meta-data, 0 omit them    */
+/* Write len bytes of data to fd. Returns 0 on success, -1 on error */
 /* ================================================================ */
-void
-display(screen_t * screen, unsigned frame_opt)
+int
+write_all(int fd, const char * data, size_t len)
 {
-  line_t *    line;
-  ll_node_t * node;
-  ll_node_t * last;
-  unsigned    n = 1;
+  ssize_t n;
 
-  if (frame_opt)
-    puts("--- virtual display top ---");
+  while (len > 0)
+  {
+    n = write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    data += n;
+    len -= n;
+  }
 
-  /* Find the latest non-empty line in the virtual screen */
-  /* """""""""""""""""""""""""""""""""""""""""""""""""""" */
-  last = screen->bottom;
-  while (last)
+  return 0;
+}
+
+/* ================================================================= */
+/* Client mode: send the standard input to the daemon listening on   */
+/* path and copy its reply to the standard output.                   */
+/* ================================================================= */
+int
+client(const char * path)
+{
+  struct sockaddr_un addr;
+  char               buf[65536];
+  ssize_t            n;
+  int                fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
   {
-    line = (line_t *)(last->data);
-    if (*(line->string) != '\0')
-      break;
-    last = last->prev;
+    fprintf(stderr, "%s: %s: path too long\n", prog, path);
+    return EXIT_FAILURE;
   }
 
-  /* Displays the used lines from the top of the virtual screen */
-  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-  node = screen->top;
-  while (node)
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+      || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
   {
-    line = (line_t *)(node->data);
-    if (frame_opt)
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0)
+  {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 || write_all(fd, buf, n) < 0)
     {
-      if (node == screen->current)
-        printf("%3d:-%s|\n", n, line->string); /* Current line */
-      else
-        printf("%3d:|%s|\n", n, line->string);
+      fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+      return EXIT_FAILURE;
     }
-    else
-      puts((char *)line->string);
+  }
+  shutdown(fd, SHUT_WR);
 
-    if (!no_attr)
+  while ((n = read(fd, buf, sizeof(buf))) != 0)
+  {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 || write_all(STDOUT_FILENO, buf, n) < 0)
     {
-      size_t i;
+      fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
 
-      for (i = 0; i < line->length; i++)
-        attrs_print(line->attrs, i);
-      puts("");
+  close(fd);
+  return 0;
+}
+
+/* ================================================================= */
+/* Send the answer to a query (DSR, DA) to the command, as if it had */
+/* been typed. It is lost if the command does not read it.           */
+/* ================================================================= */
+void
+pty_answer(const char * answer)
+{
+  if (write(pty_fd, answer, strlen(answer)) < 0)
+    return; /* nothing can be done */
+}
+
+/* ================================================================= */
+/* Run the command argv on a new pseudo-terminal of height lines and */
+/* columns columns and feed its output to the parser as it arrives,  */
+/* total counts the bytes processed. Returns when the command has    */
+/* exited and all its output has been read, or when a limit is       */
+/* reached. The command is then killed.                              */
+/* Returns the exit status of the command, 128 + the signal number   */
+/* if it has been killed by a signal, like the shells.               */
+/* ================================================================= */
+int
+pty_run(char ** argv, unsigned height, unsigned columns, vtparse_t * parser,
+        size_t * total)
+{
+  unsigned char  buf[4096];
+  struct winsize ws;
+  struct pollfd  pfd[3];
+  char *         name;
+  ssize_t        bytes;
+  pid_t          pid;
+  int            fd;
+  int            status;
+  int            exited = 0; /* 1 when the command has been waited for */
+  int            limited;
+  uint64_t       start;
+
+  if ((pty_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(pty_fd) < 0
+      || unlockpt(pty_fd) < 0 || (name = ptsname(pty_fd)) == NULL)
+  {
+    fprintf(stderr, "%s: pseudo-terminal: %s\n", prog, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_row = height > USHRT_MAX ? USHRT_MAX : height;
+  ws.ws_col = columns > USHRT_MAX ? USHRT_MAX : columns;
+  ioctl(pty_fd, TIOCSWINSZ, &ws);
+
+  fflush(stdout);
+  if ((pid = fork()) < 0)
+  {
+    fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  /* The command runs in its own session with the pseudo-terminal as */
+  /* controlling terminal and standard streams.                      */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (pid == 0)
+  {
+    close(pty_fd);
+    if (setsid() < 0 || (fd = open(name, O_RDWR)) < 0)
+      _exit(127);
+
+    ioctl(fd, TIOCSCTTY, 0);
+    dup2(fd, STDIN_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (fd > STDERR_FILENO)
+      close(fd);
+
+    execvp(argv[0], argv);
+    fprintf(stderr, "%s: %s: %s\n", prog, argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  fcntl(pty_fd, F_SETFL, O_NONBLOCK);
+  pfd[0].fd     = pty_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].events = POLLIN;
+  pfd[2].fd     = snapshot_pipe[0];
+  pfd[2].events = POLLIN;
+
+  while (!stopped)
+  {
+    snapshot_check();
+
+    STAT_CLOCK(start);
+    bytes = read(pty_fd, buf, sizeof(buf));
+    STAT_TIME(start, stats.read_ns);
+
+    if (bytes > 0)
+    {
+      limited = max_bytes && (size_t)bytes > max_bytes - *total;
+      if (limited)
+        bytes = max_bytes - *total;
+
+      *total += bytes;
+
+      STAT_CLOCK(start);
+      vtparse(parser, buf, bytes);
+      STAT_TIME(start, stats.parse_ns);
+
+      if (limited)
+        limit_reached("input size");
+      continue;
     }
 
-    if (node == last)
-      break;
+    if (bytes < 0 && errno == EINTR)
+      continue;
 
-    n++;
-    node = node->next;
+    /* Nothing to read: the output is complete if the command has    */
+    /* exited before, otherwise wait for it or for more output. The  */
+    /* background processes still holding the terminal are ignored.  */
+    /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+    if (bytes < 0 && errno == EAGAIN)
+    {
+      if (exited)
+        break;
+      if (waitpid(pid, &status, WNOHANG) == pid)
+        exited = 1; /* read what is left once more */
+      else
+      {
+        pfd[1].fd = control_fd; /* ignored by poll when -1 */
+        poll(pfd, 3, 100);
+      }
+      continue;
+    }
+
+    break; /* end of file or EIO: the terminal is no longer open */
   }
-  if (frame_opt)
-    puts("--- virtual display bottom ---");
+
+  close(pty_fd);
+  pty_fd = -1;
+
+  if (!exited)
+  {
+    if (stopped)
+      kill(pid, SIGKILL);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+  }
+
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+
+  return WEXITSTATUS(status);
 }
 
 /* ===================================== */
@@ -1329,7 +6090,14 @@ display(screen_t * screen, unsigned frame_opt)
 void
 usage(char * prog)
 {
-  printf("usage: %s [-l screen_lines] [-f] [-n]\n", prog);
+  printf("usage: %s [-l screen_lines] [-c screen_columns] [-s string_limit]\n"
+         "       [-C max_columns] [-R max_rows] [-H max_history] "
+         "[-M max_heap]\n"
+         "       [-B max_bytes] [-T trace_file] [-I index_file]\n"
+         "       [-D socket | -U socket] [-K control_fd]\n"
+         "       [-r top,left,bottom,right] [-d] [-f] [-n] [-p] [-S]\n"
+         "       [-- command [argument...]]\n",
+         prog);
   exit(EXIT_FAILURE);
 }
 
@@ -1339,20 +6107,39 @@ usage(char * prog)
 int
 main(int argc, char ** argv)
 {
-  unsigned char buf[1024];
+  static unsigned char buf[INPUT_CHUNK];
+
   int           bytes;
   int           n;
   int           end;
   int           opt;
+  int           flags;
   unsigned      height_opt;
-  unsigned      frame_opt;
+  unsigned      string_limit;
+#ifndef NO_STATS
+  unsigned      stats_opt;
+#endif
+  unsigned      pipeline_opt;
+  char *        serve_path  = NULL; /* socket of the daemon to start */
+  char *        client_path = NULL; /* socket of the daemon to use   */
+  size_t        total  = 0; /* bytes of typescript processed */
+  int           limited;    /* 1 when max_bytes is reached   */
+  int           status = 0; /* exit status of the command    */
+  uint64_t      start;
   vtparse_t     parser;
 
-  height_opt = 24; /* Defaults to 24 lines             */
-  frame_opt  = 0;  /* Displays the window's frame      */
-  no_attr    = 0;  /* Enables DEC attributes reporting */
+  struct sigaction sa; /* snapshot requests */
+
+  height_opt   = 24; /* Defaults to 24 lines             */
+#ifndef NO_STATS
+  stats_opt    = 0;  /* No statistics on stderr          */
+#endif
+  pipeline_opt = 0;  /* Parses and emulates in sequence  */
+  no_attr      = 0;  /* Enables DEC attributes reporting */
+
+  string_limit = 4096; /* Bytes kept from an OSC or DCS string */
 
-  while ((opt = my_getopt(argc, argv, "l:fn")) != -1)
+  while ((opt = my_getopt(argc, argv, "l:c:s:C:R:H:M:B:T:I:D:U:K:r:dfnpS")) != -1)
   {
     switch (opt)
     {
@@ -1364,6 +6151,89 @@ main(int argc, char ** argv)
           usage((char *)prog);
         break;
 
+      case 'c':
+        n = sscanf(my_optarg, "%u%n", &width, &end);
+        if (n != 1 || my_optarg[end] != '\0')
+          usage((char *)prog);
+        if (width == 0)
+          usage((char *)prog);
+        break;
+
+      case 's':
+        n = sscanf(my_optarg, "%u%n", &string_limit, &end);
+        if (n != 1 || my_optarg[end] != '\0')
+          usage((char *)prog);
+        break;
+
+      case 'C':
+        n = sscanf(my_optarg, "%u%n", &max_columns, &end);
+        if (n != 1 || my_optarg[end] != '\0')
+          usage((char *)prog);
+        break;
+
+      case 'R':
+        n = sscanf(my_optarg, "%u%n", &max_rows, &end);
+        if (n != 1 || my_optarg[end] != '\0')
+          usage((char *)prog);
+        break;
+
+      case 'H':
+        n = sscanf(my_optarg, "%u%n", &max_history, &end);
+        if (n != 1 || my_optarg[end] != '\0')
+          usage((char *)prog);
+        break;
+
+      case 'M':
+        if (size_opt(my_optarg, &max_heap) != 0)
+          usage((char *)prog);
+        break;
+
+      case 'B':
+        if (size_opt(my_optarg, &max_bytes) != 0)
+          usage((char *)prog);
+        break;
+
+      case 'T':
+        trace_open(my_optarg);
+        break;
+
+      case 'I':
+        index_open(my_optarg);
+        break;
+
+      case 'D':
+        serve_path = my_optarg;
+        break;
+
+      case 'U':
+        client_path = my_optarg;
+        break;
+
+      case 'K':
+        n = sscanf(my_optarg, "%d%n", &control_fd, &end);
+        if (n != 1 || my_optarg[end] != '\0' || control_fd < 0)
+          usage((char *)prog);
+        if ((flags = fcntl(control_fd, F_GETFL)) < 0
+            || fcntl(control_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+          fprintf(stderr, "%s: %d: %s\n", prog, control_fd, strerror(errno));
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      case 'r':
+        n = sscanf(my_optarg, "%d,%d,%d,%d%n", &region[0], &region[1],
+                   &region[2], &region[3], &end);
+        if (n != 4 || my_optarg[end] != '\0' || region[0] == 0
+            || region[1] == 0 || region[2] == 0 || region[3] == 0)
+          usage((char *)prog);
+        region_opt = 1;
+        break;
+
+      case 'd':
+        digest_opt = 1;
+        break;
+
       case 'f':
         frame_opt = 1;
         break;
@@ -1372,43 +6242,147 @@ main(int argc, char ** argv)
         no_attr = 1;
         break;
 
+      case 'p':
+        pipeline_opt = 1;
+        break;
+
+      case 'S':
+#ifndef NO_STATS
+        stats_opt = 1;
+#else
+        fprintf(stderr, "%s: -S is not available, built with NO_STATS\n",
+                prog);
+        exit(EXIT_FAILURE);
+#endif
+        break;
+
       default:
         usage(argv[0]);
         break;
     }
   }
 
-  if (my_optind < argc)
+  /* The arguments are the command to run, it is not read by a */
+  /* client, a daemon or the pipelined mode.                   */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (my_optind < argc
+      && (client_path != NULL || serve_path != NULL || pipeline_opt))
   {
     fputs("arguments are not allowed.\n", stderr);
     exit(EXIT_FAILURE);
   }
 
+  /* The client only forwards the typescript to the daemon */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (client_path != NULL)
+    return client(client_path);
+
+  /* The sessions of the daemon are not traced, indexed, pipelined */
+  /* nor snapshotted                                               */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (serve_path != NULL
+      && (trace_file != NULL || index_file != NULL || pipeline_opt
+          || control_fd >= 0))
+    usage((char *)prog);
+
+  /* Only the whole screen has a digest */
+  /* """""""""""""""""""""""""""""""""" */
+  if (region_opt && digest_opt)
+    usage((char *)prog);
+
+  /* The emulated screen has the width of the pseudo-terminal, for */
+  /* which the command lays its output out                         */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  if (my_optind < argc && width == 0)
+    width = 80;
+
+  if (max_rows && height_opt > max_rows)
+    height_opt = max_rows;
+  if (max_columns && width > max_columns)
+    width = max_columns;
+
   /* Various initializations */
   /* """"""""""""""""""""""" */
   vtparse_init(&parser, parser_callback);
-  screen_init(&screen, height_opt);
+  parser.string_limit = string_limit;
+  charset_init();
+  output      = stdout;
+  source.fd   = STDIN_FILENO;
+  source.read = input_read;
 
-  if (!no_attr)
-  {
-    /* Initialization of the current attributes to 'no attribute' */
-    /* """""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
-    curr_attrs_bytes.len      = 1;
-    curr_attrs_bytes.bytes    = xmalloc(1);
-    curr_attrs_bytes.bytes[0] = '\0';
-  }
+  if (serve_path != NULL)
+    serve(serve_path, height_opt, string_limit);
+
+  screen_init(&main_screen, height_opt);
+
+  /* SIGUSR1 requests a snapshot, it must interrupt the blocking reads */
+  /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  snapshot_pipe_open();
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = snapshot_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
 
   /* Parsing */
   /* """"""" */
-  do
+  if (my_optind < argc)
+    status = pty_run(argv + my_optind, height_opt, width, &parser, &total);
+  else if (pipeline_opt)
+  {
+    STAT_CLOCK(start);
+    total = pipeline_run(&parser);
+    STAT_TIME(start, stats.parse_ns);
+  }
+  else
+    do
+    {
+      STAT_CLOCK(start);
+      bytes = source_read(&source, buf, INPUT_CHUNK);
+      STAT_TIME(start, stats.read_ns);
+
+      limited = max_bytes && bytes > 0 && (size_t)bytes > max_bytes - total;
+      if (limited)
+        bytes = max_bytes - total;
+
+      total += bytes > 0 ? bytes : 0;
+
+      STAT_CLOCK(start);
+      vtparse(&parser, buf, bytes);
+      STAT_TIME(start, stats.parse_ns);
+
+      if (limited)
+      {
+        limit_reached("input size");
+        break;
+      }
+    } while (bytes > 0 && !stopped);
+
+  /* Final screen display with attributes, or only its digest */
+  /* """""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+  STAT_CLOCK(start);
+  screen_show();
+  fflush(stdout);
+  STAT_TIME(start, stats.display_ns);
+
+#ifndef NO_STATS
+  if (stats_opt)
   {
-    bytes = read(STDIN_FILENO, buf, 1024);
-    vtparse(&parser, buf, bytes);
-  } while (bytes > 0);
+    stats.bytes = total;
+    stats_print();
+  }
+#endif
 
-  /* Final screen display with attributes */
-  /* """""""""""""""""""""""""""""""""""" */
-  display(&screen, frame_opt);
+  if (trace_file != NULL)
+    trace_close();
 
-  return 0;
+  if (index_file != NULL)
+    index_close();
+
+  source_close(&source);
+
+  /* All the screen content is released at once */
+  /* """""""""""""""""""""""""""""""""""""""""" */
+  arena_release();
+
+  return status;
 }
@@ -0,0 +1,621 @@
+/* ****************************************************************** */
+/* Benchmarks of hlvt on synthetic typescripts.                       */
+/*                                                                    */
+/* Each workload is generated from a fixed seed so that the runs of   */
+/* two commits can be compared. It is processed by the parser alone   */
+/* and by the whole emulator (hlvt_bench_emu.c), each run in its own  */
+/* process to measure its peak RSS.                                   */
+/*                                                                    */
+/* The results are printed as tab separated values, one line per     */
+/* workload and mode after a header line.                             */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+
+#include "vtparse.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Size of the slices given to vtparse in the parser only mode */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define BENCH_SLICE 4096
+
+typedef struct buffer_s   buffer_t;
+typedef struct workload_s workload_t;
+typedef struct result_s   result_t;
+
+static void
+buf_add(buffer_t * b, const char * data, size_t len);
+
+static void
+buf_printf(buffer_t * b, const char * fmt, ...);
+
+static void
+buf_utf8(buffer_t * b, unsigned cp);
+
+static unsigned
+bench_rand(unsigned n);
+
+static void
+gen_log(buffer_t * b);
+
+static void
+gen_ls_color(buffer_t * b);
+
+static void
+gen_progress(buffer_t * b);
+
+static void
+gen_tui(buffer_t * b);
+
+static void
+gen_cjk(buffer_t * b);
+
+static void
+gen_osc(buffer_t * b);
+
+static void
+parser_callback(vtparse_t * parser, vtparse_action_t action,
+                unsigned char ch);
+
+static uint64_t
+now_ns(void);
+
+static void
+run_parser(buffer_t * b, result_t * r);
+
+static void
+run_emulator(const char * path, result_t * r);
+
+static int
+measure(int full, buffer_t * b, const char * path, result_t * best);
+
+static void
+usage(const char * prog);
+
+int
+hlvt_main(int argc, char ** argv);
+
+/* Growable buffer holding a generated typescript */
+/* """""""""""""""""""""""""""""""""""""""""""""" */
+struct buffer_s
+{
+  char * data;
+  size_t len;
+  size_t allocated;
+};
+
+/* A workload appends one unit (a line, a frame...) at each call of */
+/* its generator until the requested size is reached.               */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct workload_s
+{
+  const char * name;
+  void (*gen)(buffer_t * b);
+};
+
+/* Measures of a run, the child sends ns and allocs to its parent */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct result_s
+{
+  uint64_t      ns;     /* elapsed time of the processing     */
+  unsigned long allocs; /* calls to malloc, calloc and realloc */
+  long          rss;    /* peak RSS of the process in kB       */
+};
+
+static workload_t workloads[] = {
+  { "log", gen_log },     { "ls_color", gen_ls_color },
+  { "progress", gen_progress },
+  { "tui", gen_tui },     { "cjk", gen_cjk },
+  { "osc", gen_osc },
+};
+
+static unsigned      seed;
+static unsigned long actions; /* keeps the parser callback from being  *
+                               * optimized away                        */
+
+/* Allocations done by the emulator, hlvt_bench_emu.c routes them here */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+unsigned long bench_allocs;
+
+void *
+bench_malloc(size_t size)
+{
+  bench_allocs++;
+  return malloc(size);
+}
+
+void *
+bench_calloc(size_t n, size_t size)
+{
+  bench_allocs++;
+  return calloc(n, size);
+}
+
+void *
+bench_realloc(void * p, size_t size)
+{
+  bench_allocs++;
+  return realloc(p, size);
+}
+
+/* ========================================= */
+/* Append len bytes at the end of a buffer   */
+/* ========================================= */
+void
+buf_add(buffer_t * b, const char * data, size_t len)
+{
+  if (b->len + len > b->allocated)
+  {
+    b->allocated = (b->len + len) * 2;
+    b->data      = realloc(b->data, b->allocated);
+    if (b->data == NULL)
+    {
+      fputs("hlvt_bench: insufficient memory\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+/* ======================================= */
+/* Append formatted text at the end of a   */
+/* buffer.                                 */
+/* ======================================= */
+void
+buf_printf(buffer_t * b, const char * fmt, ...)
+{
+  char    tmp[512];
+  int     n;
+  va_list ap;
+
+  va_start(ap, fmt);
+  n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+
+  if (n > (int)sizeof(tmp) - 1)
+    n = sizeof(tmp) - 1;
+
+  buf_add(b, tmp, n);
+}
+
+/* ======================================= */
+/* Append a code point encoded in UTF-8    */
+/* ======================================= */
+void
+buf_utf8(buffer_t * b, unsigned cp)
+{
+  char out[4];
+  int  n;
+
+  if (cp < 0x80)
+  {
+    out[0] = cp;
+    n      = 1;
+  }
+  else if (cp < 0x800)
+  {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    n      = 2;
+  }
+  else if (cp < 0x10000)
+  {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    n      = 3;
+  }
+  else
+  {
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    n      = 4;
+  }
+
+  buf_add(b, out, n);
+}
+
+/* ================================================================ */
+/* Deterministic pseudo random number in [0, n[, the generators do  */
+/* not depend on the C library implementation of rand.              */
+/* As the evaluation order of function arguments is unspecified,    */
+/* the numbers are drawn in separate statements.                    */
+/* ================================================================ */
+unsigned
+bench_rand(unsigned n)
+{
+  seed = seed * 1103515245u + 12345u;
+
+  return (seed >> 8) % n;
+}
+
+/* ====================================== */
+/* Plain log lines, like a build output   */
+/* ====================================== */
+void
+gen_log(buffer_t * b)
+{
+  static const char * levels[] = { "INFO", "DEBUG", "WARN", "ERROR" };
+  unsigned            v[10];
+  unsigned            i;
+
+  for (i = 0; i < 10; i++)
+    v[i] = bench_rand(100000);
+
+  buf_printf(b,
+             "2024-03-%02u %02u:%02u:%02u.%03u %-5s worker[%u]: processed "
+             "item %u of batch %u in %u ms\n",
+             v[0] % 28 + 1, v[1] % 24, v[2] % 60, v[3] % 60, v[4] % 1000,
+             levels[v[5] % 4], v[6] % 16, v[7], v[8] % 500, v[9] % 2000);
+}
+
+/* ======================================================= */
+/* A line of ls --color output, each name has its own SGR  */
+/* ======================================================= */
+void
+gen_ls_color(buffer_t * b)
+{
+  static const char * colors[] = { "01;34", "01;32", "01;36", "40;33;01",
+                                   "01;31", "38;5;208", "00" };
+  unsigned            i, n = bench_rand(6) + 1;
+  unsigned            color, id;
+
+  for (i = 0; i < n; i++)
+  {
+    color = bench_rand(7);
+    id    = bench_rand(10000);
+    buf_printf(b, "\033[0m\033[%sm%s_%u%s\033[0m  ", colors[color],
+               i & 1 ? "file" : "dir", id, i & 2 ? ".tar.gz" : "");
+  }
+  buf_add(b, "\n", 1);
+}
+
+/* ================================================================= */
+/* A progress bar redrawn with CR a hundred times, then a new line   */
+/* ================================================================= */
+void
+gen_progress(buffer_t * b)
+{
+  unsigned i, filled;
+  char     bar[41];
+
+  for (i = 0; i <= 100; i++)
+  {
+    filled = i * 40 / 100;
+    memset(bar, '#', filled);
+    memset(bar + filled, '.', 40 - filled);
+    bar[40] = '\0';
+    buf_printf(b, "\r\033[32m[%s]\033[m %3u%% %u/%u ETA 00:%02u", bar, i,
+               i * 50, 5000, (100 - i) * 59 / 100);
+  }
+  buf_add(b, "\n", 1);
+}
+
+/* ================================================================== */
+/* A full screen redraw of a 80x24 TUI: a title bar, 22 rows placed   */
+/* with CUP, some in reverse video, and a status line.                */
+/* ================================================================== */
+void
+gen_tui(buffer_t * b)
+{
+  unsigned row, selected = 2 + bench_rand(22);
+  unsigned pid, cpu, mem;
+
+  buf_printf(b, "\033[H\033[7m %-78s \033[m", "htop-like monitor");
+  for (row = 2; row <= 23; row++)
+  {
+    pid = bench_rand(99999);
+    cpu = bench_rand(1000);
+    mem = bench_rand(99999);
+
+    buf_printf(b, "\033[%u;1H", row);
+    if (row == selected)
+      buf_add(b, "\033[7m", 4);
+    buf_printf(b, "%6u user  %3u.%u %5u.%uM %-48s\033[K\033[m", pid,
+               cpu / 10, cpu % 10, mem / 10, mem % 10,
+               "/usr/bin/process --flag");
+  }
+  buf_printf(b, "\033[24;1H\033[1;37;44mF1Help F2Setup F3Search F10Quit %u"
+                "\033[m\033[K",
+             bench_rand(1000));
+}
+
+/* ================================================================= */
+/* A line of CJK text with emojis, ZWJ sequences and combining marks */
+/* ================================================================= */
+void
+gen_cjk(buffer_t * b)
+{
+  unsigned i, n = 20 + bench_rand(30);
+
+  for (i = 0; i < n; i++)
+  {
+    switch (bench_rand(8))
+    {
+      case 0:
+        buf_utf8(b, 0x1f600 + bench_rand(80)); /* emoji */
+        break;
+      case 1: /* family emoji, a ZWJ sequence */
+        buf_utf8(b, 0x1f468);
+        buf_utf8(b, 0x200d);
+        buf_utf8(b, 0x1f469);
+        break;
+      case 2: /* latin letter with a combining accent */
+        buf_utf8(b, 'a' + bench_rand(26));
+        buf_utf8(b, 0x300 + bench_rand(16));
+        break;
+      case 3:
+        buf_utf8(b, 0xac00 + bench_rand(11172)); /* hangul */
+        break;
+      default:
+        buf_utf8(b, 0x4e00 + bench_rand(20000)); /* CJK ideograph */
+        break;
+    }
+  }
+  buf_add(b, "\n", 1);
+}
+
+/* ================================================================= */
+/* Window titles, hyperlinks and a large DCS payload (like a sixel   */
+/* image) between lines of text.                                     */
+/* ================================================================= */
+void
+gen_osc(buffer_t * b)
+{
+  unsigned i, n;
+
+  n = bench_rand(1000);
+  buf_printf(b, "\033]0;build %u: compiling module_%u.c\007", n, n % 97);
+  buf_printf(b, "\033]8;;https://example.com/doc/%u\033\\see the docs"
+                "\033]8;;\033\\\n",
+             bench_rand(100000));
+
+  buf_add(b, "\033Pq", 3);
+  n = 16384 + bench_rand(16384);
+  for (i = 0; i < n; i++)
+  {
+    char c = '?' + bench_rand(64);
+
+    buf_add(b, &c, 1);
+  }
+  buf_add(b, "\033\\image shown\n", 14);
+}
+
+/* ======================================================= */
+/* Parser only mode: every action is counted and dropped   */
+/* ======================================================= */
+void
+parser_callback(vtparse_t * parser, vtparse_action_t action,
+                unsigned char ch)
+{
+  (void)parser;
+  actions += action + ch;
+}
+
+/* ========================================== */
+/* Monotonic clock in nanoseconds             */
+/* ========================================== */
+uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* ============================================================= */
+/* Feed the workload to the parser alone, by slices as read(2)   */
+/* would give them.                                              */
+/* ============================================================= */
+void
+run_parser(buffer_t * b, result_t * r)
+{
+  vtparse_t parser;
+  size_t    off, n;
+  uint64_t  start;
+
+  vtparse_init(&parser, parser_callback);
+
+  start = now_ns();
+  for (off = 0; off < b->len; off += n)
+  {
+    n = b->len - off < BENCH_SLICE ? b->len - off : BENCH_SLICE;
+    vtparse(&parser, (unsigned char *)b->data + off, n);
+  }
+  r->ns     = now_ns() - start;
+  r->allocs = 0;
+}
+
+/* ================================================================ */
+/* Run the whole emulator on the workload stored in path, as hlvt   */
+/* would on a 80x24 screen, its output goes to /dev/null.           */
+/* ================================================================ */
+void
+run_emulator(const char * path, result_t * r)
+{
+  char *   argv[] = { "hlvt", "-l", "24", "-c", "80", NULL };
+  int      fd;
+  uint64_t start;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || dup2(fd, STDIN_FILENO) < 0)
+    _exit(EXIT_FAILURE);
+  close(fd);
+
+  if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+    _exit(EXIT_FAILURE);
+  close(fd);
+
+  bench_allocs = 0;
+  start        = now_ns();
+  hlvt_main(5, argv);
+  fflush(stdout);
+  r->ns     = now_ns() - start;
+  r->allocs = bench_allocs;
+}
+
+/* ================================================================= */
+/* Run a workload once in a child process, so that the peak RSS only */
+/* covers this run.                                                  */
+/* The best time of the runs is kept in best.                        */
+/* Returns 0 on success and -1 if the run failed.                    */
+/* ================================================================= */
+int
+measure(int full, buffer_t * b, const char * path, result_t * best)
+{
+  int           fds[2];
+  int           status;
+  pid_t         pid;
+  result_t      r;
+  struct rusage usage;
+
+  if (pipe(fds) < 0)
+    return -1;
+
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0)
+    return -1;
+
+  if (pid == 0)
+  {
+    close(fds[0]);
+    if (full)
+      run_emulator(path, &r);
+    else
+      run_parser(b, &r);
+
+    if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+      _exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], &r, sizeof(r)) != sizeof(r))
+    r.ns = 0;
+  close(fds[0]);
+
+  if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0 || r.ns == 0)
+    return -1;
+
+  if (best->ns == 0 || r.ns < best->ns)
+    best->ns = r.ns;
+  best->allocs = r.allocs;
+  if (usage.ru_maxrss > best->rss)
+    best->rss = usage.ru_maxrss;
+
+  return 0;
+}
+
+/* ===================================== */
+/* Usage display in case of syntax error */
+/* ===================================== */
+void
+usage(const char * prog)
+{
+  printf("usage: %s [-s size_in_MiB] [-r runs] [workload...]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+/* ============= */
+/* Program entry */
+/* ============= */
+int
+main(int argc, char ** argv)
+{
+  unsigned size_mib = 16; /* size of each workload */
+  unsigned runs     = 3;  /* the best time is kept */
+  unsigned w, i;
+  int      opt, full, selected;
+  char     path[] = "/tmp/hlvt_benchXXXXXX";
+  int      fd;
+  buffer_t b = { NULL, 0, 0 };
+  result_t r;
+
+  while ((opt = getopt(argc, argv, "s:r:")) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+        if (sscanf(optarg, "%u", &size_mib) != 1 || size_mib == 0)
+          usage(argv[0]);
+        break;
+
+      case 'r':
+        if (sscanf(optarg, "%u", &runs) != 1 || runs == 0)
+          usage(argv[0]);
+        break;
+
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  puts("workload\tmode\tbytes\tseconds\tMB/s\tns/byte\tallocs\tpeak_rss_kB");
+
+  for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+  {
+    /* Without arguments, all the workloads are run */
+    /* """""""""""""""""""""""""""""""""""""""""""" */
+    selected = optind == argc;
+    for (i = optind; i < (unsigned)argc; i++)
+      if (strcmp(argv[i], workloads[w].name) == 0)
+        selected = 1;
+    if (!selected)
+      continue;
+
+    seed  = 1;
+    b.len = 0;
+    while (b.len < (size_t)size_mib << 20)
+      workloads[w].gen(&b);
+
+    /* The emulator reads its input from a file */
+    /* """""""""""""""""""""""""""""""""""""""" */
+    if ((fd = mkstemp(path)) < 0
+        || write(fd, b.data, b.len) != (ssize_t)b.len)
+    {
+      perror("hlvt_bench");
+      exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    for (full = 0; full <= 1; full++)
+    {
+      memset(&r, 0, sizeof(r));
+      for (i = 0; i < runs; i++)
+        if (measure(full, &b, path, &r) != 0)
+        {
+          fprintf(stderr, "hlvt_bench: %s run failed\n", workloads[w].name);
+          unlink(path);
+          exit(EXIT_FAILURE);
+        }
+
+      printf("%s\t%s\t%lu\t%.4f\t%.1f\t%.2f\t%lu\t%ld\n", workloads[w].name,
+             full ? "emulator" : "parser", (unsigned long)b.len,
+             r.ns / 1e9, b.len / 1e6 / (r.ns / 1e9), (double)r.ns / b.len,
+             r.allocs, r.rss);
+    }
+
+    unlink(path);
+    strcpy(path, "/tmp/hlvt_benchXXXXXX");
+  }
+
+  free(b.data);
+
+  return 0;
+}
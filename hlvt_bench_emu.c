@@ -0,0 +1,22 @@
+/* ****************************************************************** */
+/* The emulator built into hlvt_bench: hlvt.c compiled with its main  */
+/* renamed and its allocations counted by hlvt_bench.c.               */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+
+#include <stddef.h>
+
+void *
+bench_malloc(size_t size);
+
+void *
+bench_calloc(size_t n, size_t size);
+
+void *
+bench_realloc(void * p, size_t size);
+
+#define main    hlvt_main
+#define malloc  bench_malloc
+#define calloc  bench_calloc
+#define realloc bench_realloc
+
+#include "hlvt.c"
@@ -0,0 +1,375 @@
+/* ****************************************************************** */
+/* Dumper of the binary traces written by hlvt -T.                    */
+/*                                                                    */
+/* Without option, each record is printed on its own line with the    */
+/* sequence rebuilt from it. With -s, the records are grouped by      */
+/* sequence (the parameters are ignored) and the groups are printed   */
+/* by decreasing number of typescript bytes.                          */
+/*                                                                    */
+/* The bytes of a record are the bytes of the typescript since the    */
+/* end of the previous record, they include the whole sequence and    */
+/* the bytes ignored by the parser before it.                         */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+
+#include "hlvt_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of records read at once */
+/* """""""""""""""""""""""""""""" */
+#define DUMP_RECORDS 4096
+
+/* Size of the table of the sequences seen by -s. It is never filled  */
+/* to more than a half, the sequences which do not fit are counted    */
+/* together.                                                          */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define GROUPS 65536
+
+typedef struct group_s group_t;
+
+/* Records of a same sequence, key is 0 for a free slot */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct group_s
+{
+  uint32_t           key;
+  unsigned long      count;  /* number of records         */
+  unsigned long long bytes;  /* typescript bytes          */
+  trace_record_t     sample; /* first record of the group */
+};
+
+static void
+usage(const char * prog);
+
+static void
+read_header(FILE * f, const char * path);
+
+static uint32_t
+record_key(const trace_record_t * rec);
+
+static void
+record_string(const trace_record_t * rec, int with_params, char * out);
+
+static void
+group_add(const trace_record_t * rec, unsigned long long bytes);
+
+static int
+group_cmp(const void * a, const void * b);
+
+static void
+summary_print(void);
+
+static group_t *    groups;
+static group_t      other; /* sequences not fitting in groups */
+static unsigned     nb_groups;
+static const char * prog = "hlvt_trace";
+
+/* ===================================== */
+/* Usage display in case of syntax error */
+/* ===================================== */
+void
+usage(const char * prog)
+{
+  printf("usage: %s [-s] [trace_file]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+/* ================================================================ */
+/* Check that the file is a trace written by a compatible hlvt on a */
+/* machine with the same byte order.                                */
+/* ================================================================ */
+void
+read_header(FILE * f, const char * path)
+{
+  trace_header_t header;
+
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0)
+  {
+    fprintf(stderr, "%s: %s: not a hlvt trace\n", prog, path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (header.byte_order != TRACE_BYTE_ORDER)
+  {
+    fprintf(stderr, "%s: %s: written with another byte order\n", prog, path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (header.version != TRACE_VERSION
+      || header.record_size != sizeof(trace_record_t))
+  {
+    fprintf(stderr, "%s: %s: unsupported trace version %u\n", prog, path,
+            (unsigned)header.version);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* ================================================================= */
+/* Key of the sequence of a record: the action, the final byte and   */
+/* the intermediates. Only the control character is kept for the     */
+/* EXECUTE actions and nothing for the other ones. Never 0.          */
+/* ================================================================= */
+uint32_t
+record_key(const trace_record_t * rec)
+{
+  switch (rec->action)
+  {
+    case VTPARSE_ACTION_CSI_DISPATCH:
+    case VTPARSE_ACTION_ESC_DISPATCH:
+    case VTPARSE_ACTION_HOOK:
+      return rec->action | rec->ch << 8 | rec->intermediates[0] << 16
+             | (uint32_t)rec->intermediates[1] << 24;
+
+    case VTPARSE_ACTION_EXECUTE:
+      return rec->action | rec->ch << 8;
+
+    default:
+      return rec->action & 15;
+  }
+}
+
+/* ================================================================= */
+/* Build in out (at least 128 bytes) the readable form of a record.  */
+/* The sequences are shown like in the documentations, the private   */
+/* markers ("<=>?") before the parameters and the other              */
+/* intermediates after them.                                         */
+/* ================================================================= */
+void
+record_string(const trace_record_t * rec, int with_params, char * out)
+{
+  char *   p = out;
+  unsigned i;
+
+  switch (rec->action)
+  {
+    case VTPARSE_ACTION_CSI_DISPATCH:
+    case VTPARSE_ACTION_HOOK:
+      p += sprintf(p, "%s ",
+                   rec->action == VTPARSE_ACTION_HOOK ? "DCS" : "CSI");
+      for (i = 0; i < rec->num_intermediates; i++)
+        if (rec->intermediates[i] >= 0x3c)
+          *p++ = rec->intermediates[i];
+      if (with_params)
+      {
+        for (i = 0; i < rec->num_params; i++)
+          p += sprintf(p, "%s%u",
+                       i == 0                        ? ""
+                       : rec->subparams & (1u << i) ? ":"
+                                                     : ";",
+                       (unsigned)rec->params[i]);
+        if (rec->params_overflow)
+          p += sprintf(p, ";...");
+      }
+      for (i = 0; i < rec->num_intermediates; i++)
+        if (rec->intermediates[i] < 0x3c)
+          *p++ = rec->intermediates[i];
+      *p++ = rec->ch;
+      *p   = '\0';
+      break;
+
+    case VTPARSE_ACTION_ESC_DISPATCH:
+      p += sprintf(p, "ESC ");
+      for (i = 0; i < rec->num_intermediates; i++)
+        *p++ = rec->intermediates[i];
+      *p++ = rec->ch;
+      *p   = '\0';
+      break;
+
+    case VTPARSE_ACTION_EXECUTE:
+      sprintf(p, "EXECUTE 0x%02x", (unsigned)rec->ch);
+      break;
+
+    case VTPARSE_ACTION_PRINT:
+    case VTPARSE_ACTION_OSC_PUT:
+    case VTPARSE_ACTION_PUT:
+      if (with_params)
+        sprintf(p, "%s %lu", ACTION_NAMES[rec->action],
+                (unsigned long)rec->count);
+      else
+        sprintf(p, "%s", ACTION_NAMES[rec->action]);
+      break;
+
+    default:
+      sprintf(p, "%s", ACTION_NAMES[rec->action & 15]);
+      break;
+  }
+}
+
+/* ================================================================ */
+/* Count a record in the group of its sequence, the table is hashed */
+/* with linear probing.                                             */
+/* ================================================================ */
+void
+group_add(const trace_record_t * rec, unsigned long long bytes)
+{
+  uint32_t  key = record_key(rec);
+  unsigned  i;
+  group_t * g = &other;
+
+  i = (key * 2654435761u) % GROUPS;
+  for (;; i = (i + 1) % GROUPS)
+  {
+    if (groups[i].key == key)
+    {
+      g = &groups[i];
+      break;
+    }
+
+    if (groups[i].key == 0)
+    {
+      if (nb_groups >= GROUPS / 2)
+        break;
+
+      g         = &groups[i];
+      g->key    = key;
+      g->sample = *rec;
+      nb_groups++;
+      break;
+    }
+  }
+
+  g->count++;
+  g->bytes += bytes;
+}
+
+/* ============================================================ */
+/* qsort comparison: the free slots last, then by bytes and by  */
+/* number of records in decreasing order.                       */
+/* ============================================================ */
+int
+group_cmp(const void * a, const void * b)
+{
+  const group_t * ga = a;
+  const group_t * gb = b;
+
+  if ((ga->key == 0) != (gb->key == 0))
+    return ga->key == 0 ? 1 : -1;
+  if (ga->bytes != gb->bytes)
+    return ga->bytes < gb->bytes ? 1 : -1;
+  if (ga->count != gb->count)
+    return ga->count < gb->count ? 1 : -1;
+
+  return 0;
+}
+
+/* ================================================================ */
+/* Print the groups as tab separated values after a header line.    */
+/* ================================================================ */
+void
+summary_print(void)
+{
+  unsigned i;
+  char     s[128];
+
+  qsort(groups, GROUPS, sizeof(group_t), group_cmp);
+
+  puts("records\tbytes\tsequence");
+  for (i = 0; i < nb_groups; i++)
+  {
+    record_string(&groups[i].sample, 0, s);
+    printf("%lu\t%llu\t%s\n", groups[i].count, groups[i].bytes, s);
+  }
+
+  if (other.count > 0)
+    printf("%lu\t%llu\t(other)\n", other.count, other.bytes);
+}
+
+/* ============= */
+/* Program entry */
+/* ============= */
+int
+main(int argc, char ** argv)
+{
+  static trace_record_t recs[DUMP_RECORDS];
+
+  FILE *             f    = stdin;
+  const char *       path = "(stdin)";
+  int                opt;
+  int                summary = 0;
+  size_t             n, i;
+  unsigned long long end = 0; /* end of the previous record */
+  unsigned long long rec_end, bytes;
+  char               s[128];
+
+  while ((opt = getopt(argc, argv, "s")) != -1)
+  {
+    switch (opt)
+    {
+      case 's':
+        summary = 1;
+        break;
+
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (argc - optind > 1)
+    usage(argv[0]);
+
+  if (optind < argc)
+  {
+    path = argv[optind];
+    if ((f = fopen(path, "rb")) == NULL)
+    {
+      fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  read_header(f, path);
+
+  if (summary && (groups = calloc(GROUPS, sizeof(group_t))) == NULL)
+  {
+    fprintf(stderr, "%s: %s\n", prog, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (!summary)
+    puts("offset\tbytes\tsequence");
+
+  while ((n = fread(recs, sizeof(trace_record_t), DUMP_RECORDS, f)) > 0)
+    for (i = 0; i < n; i++)
+    {
+      /* The PRINT and the payloads cover count bytes, an ERROR none */
+      /* and the other actions the byte which triggered them.        */
+      /* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+      rec_end = recs[i].offset;
+      if (recs[i].action == VTPARSE_ACTION_PRINT
+          || recs[i].action == VTPARSE_ACTION_OSC_PUT
+          || recs[i].action == VTPARSE_ACTION_PUT)
+        rec_end += recs[i].count;
+      else if (recs[i].action != VTPARSE_ACTION_ERROR)
+        rec_end++;
+
+      bytes = rec_end > end ? rec_end - end : 0;
+      if (rec_end > end)
+        end = rec_end;
+
+      if (summary)
+        group_add(&recs[i], bytes);
+      else
+      {
+        record_string(&recs[i], 1, s);
+        printf("%llu\t%llu\t%s\n", (unsigned long long)recs[i].offset,
+               bytes, s);
+      }
+    }
+
+  if (ferror(f))
+  {
+    fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (summary)
+  {
+    summary_print();
+    free(groups);
+  }
+
+  return 0;
+}
@@ -0,0 +1,53 @@
+/* ****************************************************************** */
+/* Binary trace of the parser actions written by hlvt -T and read by  */
+/* hlvt_trace.                                                        */
+/* """""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+
+#ifndef HLVT_TRACE_H
+#define HLVT_TRACE_H
+
+#include <stdint.h>
+#include "vtparse.h"
+
+/* The file starts with a trace_header_t followed by trace_record_t    */
+/* records until its end. Both are written in the byte order of the    */
+/* machine running hlvt, byte_order tells which one it is.             */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+#define TRACE_MAGIC      "HLVTTRC"
+#define TRACE_VERSION    1
+#define TRACE_BYTE_ORDER 0x01020304u
+
+typedef struct trace_header_s trace_header_t;
+typedef struct trace_record_s trace_record_t;
+
+struct trace_header_s
+{
+  char     magic[8];    /* TRACE_MAGIC, NUL terminated      */
+  uint16_t version;     /* TRACE_VERSION                    */
+  uint16_t record_size; /* sizeof(trace_record_t)           */
+  uint32_t byte_order;  /* TRACE_BYTE_ORDER as written      */
+};
+
+/* One record per action received from the parser. The consecutive     */
+/* PRINT actions are merged into a single record, count is then the    */
+/* number of bytes printed. The contiguous slices of an OSC_PUT or PUT */
+/* payload are merged too, count is then the length of the payload.    */
+/* The intermediates are only set for the CSI_DISPATCH, ESC_DISPATCH   */
+/* and HOOK actions, the parameters for CSI_DISPATCH and HOOK.         */
+/* """"""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""""" */
+struct trace_record_s
+{
+  uint64_t offset;            /* offset of the byte in the typescript */
+  uint32_t count;             /* merged actions or payload length      */
+  uint16_t subparams;         /* bit i set: params[i] follows a ':'    */
+  uint8_t  action;            /* vtparse_action_t                      */
+  uint8_t  ch;                /* byte which triggered the action       */
+  uint8_t  num_intermediates;
+  uint8_t  num_params;
+  uint8_t  intermediates[MAX_INTERMEDIATE_CHARS];
+  uint8_t  params_overflow;   /* 1 if parameters have been dropped     */
+  uint8_t  reserved[3];
+  uint16_t params[MAX_PARAMS];
+};
+
+#endif
@@ -6,6 +6,7 @@
  * This code is in the public domain.
  */
 
+#include <string.h>
 #include "vtparse.h"
 
 void vtparse_init(vtparse_t *parser, vtparse_callback_t cb)
@@ -13,8 +14,15 @@ void vtparse_init(vtparse_t *parser, vtparse_callback_t cb)
     parser->state                  = VTPARSE_STATE_GROUND;
     parser->num_intermediate_chars = 0;
     parser->num_params             = 0;
+    parser->subparams              = 0;
+    parser->params_overflow        = 0;
     parser->ignore_flagged         = 0;
     parser->cb                     = cb;
+    parser->string_data            = NULL;
+    parser->string_data_len        = 0;
+    parser->string_len             = 0;
+    parser->string_limit           = 0;
+    parser->offset                 = 0;
 }
 
 static void do_action(vtparse_t *parser, vtparse_action_t action, unsigned char ch)
@@ -23,12 +31,24 @@ static void do_action(vtparse_t *parser, vtparse_action_t action, unsigned char
      * we hand to our client for processing */
 
     switch(action) {
-        case VTPARSE_ACTION_PRINT:
-        case VTPARSE_ACTION_EXECUTE:
         case VTPARSE_ACTION_HOOK:
-        case VTPARSE_ACTION_PUT:
         case VTPARSE_ACTION_OSC_START:
+            parser->string_len = 0;
+            parser->cb(parser, action, ch);
+            break;
+
+        case VTPARSE_ACTION_PUT:
         case VTPARSE_ACTION_OSC_PUT:
+            /* only reached when a string byte is not bulk scanned */
+            parser->string_data     = &ch;
+            parser->string_data_len = 1;
+            if(parser->string_limit == 0 ||
+               parser->string_len++ < parser->string_limit)
+                parser->cb(parser, action, ch);
+            break;
+
+        case VTPARSE_ACTION_PRINT:
+        case VTPARSE_ACTION_EXECUTE:
         case VTPARSE_ACTION_OSC_END:
         case VTPARSE_ACTION_UNHOOK:
         case VTPARSE_ACTION_CSI_DISPATCH:
@@ -54,25 +74,38 @@ static void do_action(vtparse_t *parser, vtparse_action_t action, unsigned char
         case VTPARSE_ACTION_PARAM:
         {
             /* process the param character */
-            if(ch == ';')
+            unsigned short *current_param;
+
+            if(parser->params_overflow)
+                break;
+
+            /* an empty first parameter is still a parameter */
+            if(parser->num_params == 0)
             {
-                parser->num_params += 1;
-                parser->params[parser->num_params-1] = 0;
+                parser->num_params = 1;
+                parser->params[0]  = 0;
             }
-            else
-            {
-                /* the character is a digit */
-                unsigned char current_param;
 
-                if(parser->num_params == 0)
+            if(ch == ';' || ch == ':')
+            {
+                if(parser->num_params == MAX_PARAMS)
                 {
-                    parser->num_params = 1;
-                    parser->params[0]  = 0;
+                    parser->params_overflow = 1;
+                    break;
                 }
 
-                current_param = parser->num_params - 1;
-                parser->params[current_param] *= 10;
-                parser->params[current_param] += (ch - '0');
+                if(ch == ':')
+                    parser->subparams |= 1u << parser->num_params;
+                parser->params[parser->num_params++] = 0;
+            }
+            else
+            {
+                /* the character is a digit */
+                current_param = &parser->params[parser->num_params - 1];
+                if(*current_param > (MAX_PARAM_VALUE - (ch - '0')) / 10)
+                    *current_param = MAX_PARAM_VALUE;
+                else
+                    *current_param = *current_param * 10 + (ch - '0');
             }
 
             break;
@@ -81,6 +114,8 @@ static void do_action(vtparse_t *parser, vtparse_action_t action, unsigned char
         case VTPARSE_ACTION_CLEAR:
             parser->num_intermediate_chars = 0;
             parser->num_params            = 0;
+            parser->subparams             = 0;
+            parser->params_overflow       = 0;
             parser->ignore_flagged        = 0;
             break;
 
@@ -114,8 +149,10 @@ static void do_state_change(vtparse_t *parser, state_change_t change, unsigned c
         if(action)
             do_action(parser, action, ch);
 
+        /* the entry action receives the byte which caused the
+         * transition, it is the final byte of the sequence for HOOK */
         if(entry_action)
-            do_action(parser, entry_action, 0);
+            do_action(parser, entry_action, ch);
 
         parser->state = new_state;
     }
@@ -125,14 +162,108 @@ static void do_state_change(vtparse_t *parser, state_change_t change, unsigned c
     }
 }
 
+/* Returns the length of the part of a string payload at the start of
+ * data, it ends before the first byte which terminates the string
+ * (ESC, CAN, SUB) or which is not part of the payload and is left to
+ * the state table: the C0 controls in an OSC string, which include
+ * BEL, and DEL in a DCS string. */
+static int string_span(vtparse_state_t state, unsigned char *data, int len)
+{
+    unsigned char *end = data + len;
+    unsigned char *p;
+
+    if(state == VTPARSE_STATE_OSC_STRING)
+    {
+        for(p = data; p < end && *p >= 0x20; p++)
+            ;
+        return p - data;
+    }
+
+    if((p = memchr(data, 0x1b, end - data)) != NULL)
+        end = p;
+    if(state == VTPARSE_STATE_DCS_PASSTHROUGH &&
+       (p = memchr(data, 0x7f, end - data)) != NULL)
+        end = p;
+    if((p = memchr(data, 0x18, end - data)) != NULL)
+        end = p;
+    if((p = memchr(data, 0x1a, end - data)) != NULL)
+        end = p;
+
+    return end - data;
+}
+
+/* Deliver a slice of a string payload to the client, truncated to the
+ * string limit */
+static void string_put(vtparse_t *parser, vtparse_action_t action,
+                       unsigned char *data, int len)
+{
+    if(parser->string_limit > 0)
+    {
+        if(parser->string_len >= parser->string_limit)
+            return;
+        if(len > parser->string_limit - parser->string_len)
+            len = parser->string_limit - parser->string_len;
+    }
+
+    parser->string_len      += len;
+    parser->string_data     = data;
+    parser->string_data_len = len;
+    parser->cb(parser, action, 0);
+}
+
 void vtparse(vtparse_t *parser, unsigned char *data, int len)
 {
-    int i;
-    for(i = 0; i < len; i++)
+    int i = 0;
+    int n;
+
+    while(i < len)
     {
-        unsigned char ch = data[i];
-        state_change_t change = STATE_TABLE[parser->state-1][ch];
+        unsigned char ch;
+        state_change_t change;
+
+        /* The payload of a string is scanned in bulk for its terminator
+         * instead of going through the state table byte by byte */
+        switch(parser->state)
+        {
+            case VTPARSE_STATE_OSC_STRING:
+            case VTPARSE_STATE_DCS_PASSTHROUGH:
+            case VTPARSE_STATE_DCS_IGNORE:
+            case VTPARSE_STATE_SOS_PM_APC_STRING:
+                n = string_span(parser->state, data + i, len - i);
+                if(n == 0)
+                    break;
+
+                if(parser->state == VTPARSE_STATE_OSC_STRING)
+                    string_put(parser, VTPARSE_ACTION_OSC_PUT, data + i, n);
+                else if(parser->state == VTPARSE_STATE_DCS_PASSTHROUGH)
+                    string_put(parser, VTPARSE_ACTION_PUT, data + i, n);
+
+                i += n;
+                parser->offset += n;
+                continue;
+
+            default:
+                break;
+        }
+
+        ch = data[i++];
+        change = STATE_TABLE[parser->state-1][ch];
+
+        /* A byte which cannot continue a UTF-8 sequence reports the
+         * truncated sequence, then is processed again from GROUND so that
+         * a malformed character cannot swallow the bytes which follow */
+        if(change == 0 &&
+           parser->state >= VTPARSE_STATE_UTF8_2 &&
+           parser->state <= VTPARSE_STATE_UTF8_4_F4)
+        {
+            parser->cb(parser, VTPARSE_ACTION_ERROR, 0);
+            parser->state = VTPARSE_STATE_GROUND;
+            i--;
+            continue;
+        }
+
         do_state_change(parser, change, ch);
+        parser->offset++;
     }
 }
 
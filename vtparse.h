@@ -16,6 +16,8 @@ extern "C" {
 #include "vtparse_table.h"
 
 #define MAX_INTERMEDIATE_CHARS 2
+#define MAX_PARAMS             16
+#define MAX_PARAM_VALUE        65535
 #define ACTION(state_change) (state_change & 0x0F)
 #define STATE(state_change)  (state_change >> 4)
 
@@ -29,9 +31,27 @@ typedef struct vtparse {
     unsigned char                intermediate_chars[MAX_INTERMEDIATE_CHARS+1];
     int                num_intermediate_chars;
     char               ignore_flagged;
-    unsigned char                params[16];
-    int                num_params;
+    /* A parameter following a ':' is a sub-parameter of the previous
+     * one, the bit of its index is then set in subparams. The values
+     * saturate at MAX_PARAM_VALUE and the parameters after the
+     * MAX_PARAMS first ones are dropped and flagged in params_overflow. */
+    unsigned short     params[MAX_PARAMS];
+    unsigned           num_params;
+    unsigned           subparams;
+    char               params_overflow;
     void*              user_data;
+
+    /* The payloads of the OSC and DCS strings are not delivered byte by
+     * byte: the OSC_PUT and PUT actions receive a slice of the input in
+     * string_data/string_data_len. At most string_limit bytes of each
+     * string are delivered (no limit if 0), the rest is skipped. */
+    unsigned char*     string_data;
+    int                string_data_len;
+    int                string_len;
+    int                string_limit;
+
+    /* Offset in the whole input of the byte being processed */
+    unsigned long long offset;
 } vtparse_t;
 
 void vtparse_init(vtparse_t *parser, vtparse_callback_t cb);
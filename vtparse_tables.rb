@@ -128,9 +128,7 @@ $states[:CSI_ENTRY] = {
     0x1c..0x1f => :execute,
     0x7f       => :ignore,
     0x20..0x2f => [:collect, transition_to(:CSI_INTERMEDIATE)],
-    0x3a       => transition_to(:CSI_IGNORE),
-    0x30..0x39 => [:param, transition_to(:CSI_PARAM)],
-    0x3b       => [:param, transition_to(:CSI_PARAM)],
+    0x30..0x3b => [:param, transition_to(:CSI_PARAM)],
     0x3c..0x3f => [:collect, transition_to(:CSI_PARAM)],
     0x40..0x7e => [:csi_dispatch, transition_to(:GROUND)]
 }
@@ -148,10 +146,8 @@ $states[:CSI_PARAM] = {
     0x00..0x17 => :execute,
     0x19       => :execute,
     0x1c..0x1f => :execute,
-    0x30..0x39 => :param,
-    0x3b       => :param,
+    0x30..0x3b => :param,
     0x7f       => :ignore,
-    0x3a       => transition_to(:CSI_IGNORE),
     0x3c..0x3f => transition_to(:CSI_IGNORE),
     0x20..0x2f => [:collect, transition_to(:CSI_INTERMEDIATE)],
     0x40..0x7e => [:csi_dispatch, transition_to(:GROUND)]
@@ -195,7 +191,7 @@ $states[:DCS_IGNORE] = {
     0x00..0x17 => :ignore,
     0x19       => :ignore,
     0x1c..0x1f => :ignore,
-    0x20..0x7f => :ignore,
+    0x20..0xff => :ignore,
 }
 
 $states[:DCS_PARAM] = {
@@ -218,6 +214,7 @@ $states[:DCS_PASSTHROUGH] = {
     0x1c..0x1f => :put,
     0x20..0x7e => :put,
     0x7f       => :ignore,
+    0x80..0xff => :put,
     :on_exit   => :unhook
 }
 
@@ -225,15 +222,17 @@ $states[:SOS_PM_APC_STRING] = {
     0x00..0x17 => :ignore,
     0x19       => :ignore,
     0x1c..0x1f => :ignore,
-    0x20..0x7f => :ignore,
+    0x20..0xff => :ignore,
 }
 
 $states[:OSC_STRING] = {
     :on_entry  => :osc_start,
-    0x00..0x17 => :ignore,
+    0x00..0x06 => :ignore,
+    0x07       => transition_to(:GROUND),
+    0x08..0x17 => :ignore,
     0x19       => :ignore,
     0x1c..0x1f => :ignore,
-    0x20..0x7f => :osc_put,
+    0x20..0xff => :osc_put,
     :on_exit   => :osc_end
 }
 
@@ -273,7 +272,7 @@ def expand_ranges(hash_with_ranges_as_keys)
             range.each { |i|
                 array[i] = val
             }
-        elsif range.kind_of?(Fixnum)
+        elsif range.kind_of?(Integer)
             array[range] = val
         end
     }
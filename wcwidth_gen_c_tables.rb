@@ -0,0 +1,69 @@
+require './wcwidth_tables'
+
+# The width of a character is found with two lookups: the high bits of
+# the code point select a 256 entries block, identical blocks being only
+# stored once, and the low byte selects the width in this block.
+
+widths = Array.new(0x110000, 1)
+
+$zero_width.each { |range|
+    range = range..range if range.kind_of?(Integer)
+    range.each { |cp| widths[cp] = 0 }
+}
+
+$double_width.each { |range|
+    range = range..range if range.kind_of?(Integer)
+    range.each { |cp| widths[cp] = 2 }
+}
+
+blocks = []
+block_ids = {}
+index = []
+
+widths.each_slice(256) { |block|
+    id = block_ids[block]
+    if not id
+        id = block_ids[block] = blocks.length
+        blocks << block
+    end
+    index << id
+}
+
+if blocks.length > 256
+    raise "too many width blocks (#{blocks.length}) for an unsigned char index"
+end
+
+File.open("wcwidth_table.h", "w") { |f|
+    f.puts "#define WIDTH_BLOCK_SHIFT 8"
+    f.puts "#define WIDTH_BLOCK_MASK  0xff"
+    f.puts
+    f.puts "extern const unsigned char WIDTH_INDEX[#{index.length}];"
+    f.puts "extern const unsigned char WIDTH_BLOCKS[#{blocks.length}][256];"
+    f.puts
+}
+
+puts "Wrote wcwidth_table.h"
+
+File.open("wcwidth_table.c", "w") { |f|
+    f.puts
+    f.puts '#include "wcwidth_table.h"'
+    f.puts
+    f.puts "const unsigned char WIDTH_INDEX[#{index.length}] = {"
+    index.each_slice(16) { |ids|
+        f.puts "   " + ids.map { |id| "#{id}," }.join(" ")
+    }
+    f.puts "};"
+    f.puts
+    f.puts "const unsigned char WIDTH_BLOCKS[#{blocks.length}][256] = {"
+    blocks.each_with_index { |block, i|
+        f.puts "  {  /* block #{i} */"
+        block.each_slice(32) { |w|
+            f.puts "    " + w.join(",") + ","
+        }
+        f.puts "  },"
+    }
+    f.puts "};"
+    f.puts
+}
+
+puts "Wrote wcwidth_table.c"